@@ -51,6 +51,13 @@ static inline void spinlock_lock(spinlock_t* lock)
   mb();
 }
 
+static inline int spinlock_trylock(spinlock_t* lock)
+{
+  int res = atomic_swap(&lock->lock, -1);
+  mb();
+  return res;
+}
+
 static inline void spinlock_unlock(spinlock_t* lock)
 {
   mb();
@@ -25,6 +25,16 @@ void run_loaded_program(struct mainvars* args)
     enter_entry_point();
 }
 
+void run_restored_program(const char* path)
+{
+  panic("bbl can't restore checkpoints; try using pk instead");
+}
+
+void rerun_loaded_program(struct mainvars* args)
+{
+  panic("bbl can't run user binaries; try using pk instead");
+}
+
 void boot_other_hart()
 {
   while (!elf_loaded)
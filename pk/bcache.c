@@ -0,0 +1,148 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// Block cache for file reads (-k<KiB>). Page faults on file-backed memory
+// and small reads used to cost one host pread per page; here they are served
+// from a few windows of recently read file data, keyed by host fd and
+// offset. A miss fetches a whole run of the file at once, starting small and
+// doubling while a file is read sequentially, up to the size of a window.
+//
+// The cache only ever holds what the host returned: writes and truncations
+// drop it, as does closing the host fd, since the host will reuse the number.
+
+#include "pk.h"
+#include "file.h"
+#include "vm.h"
+#include "frontend.h"
+#include "syscall.h"
+#include "atomic.h"
+#include <string.h>
+
+#define BCACHE_WAYS 4
+#define BCACHE_MIN_FETCH (4 * RISCV_PGSIZE)
+
+typedef struct {
+  int kfd;        // -1 if the entry is empty
+  off_t off;
+  size_t len;     // bytes the host returned; fewer than asked for at EOF
+  char* buf;
+  unsigned long used;
+} bcache_entry_t;
+
+size_t bcache_size = 0; //MWG: -k, in bytes
+long bcache_hits, bcache_lookups;
+static bcache_entry_t entries[BCACHE_WAYS];
+static size_t window; // bytes per entry
+static unsigned long bcache_clock;
+static spinlock_t bcache_lock = SPINLOCK_INIT;
+
+//MWG: Must run after pk_vm_init(), since the windows come from the page pool.
+void bcache_init()
+{
+  if (!bcache_size)
+    return;
+
+  window = MAX(RISCV_PGSIZE, ROUNDUP(bcache_size / BCACHE_WAYS, RISCV_PGSIZE));
+  size_t ways = 0;
+  for (size_t i = 0; i < BCACHE_WAYS; i++) {
+    entries[i].kfd = -1;
+    if ((entries[i].buf = (char*)kernel_page_alloc(window / RISCV_PGSIZE)))
+      ways++;
+  }
+  if (ways == 0) {
+    printk("pk: no memory for the block cache\n");
+    bcache_size = window = 0;
+  }
+}
+
+static ssize_t host_pread(file_t* f, void* buf, size_t n, off_t off)
+{
+  return frontend_syscall(SYS_pread, f->kfd, (uintptr_t)buf, n, off, 0, 0, 0);
+}
+
+static bcache_entry_t* bcache_lookup(int kfd, off_t off)
+{
+  for (bcache_entry_t* e = entries; e < entries + BCACHE_WAYS; e++)
+    if (e->kfd == kfd && off >= e->off && off < e->off + (off_t)e->len)
+      return e;
+  return NULL;
+}
+
+// Reads the run of f around off into the least recently used window.
+static bcache_entry_t* bcache_fill(file_t* f, off_t off, ssize_t* err)
+{
+  bcache_entry_t* e = NULL;
+  for (bcache_entry_t* v = entries; v < entries + BCACHE_WAYS; v++)
+    if (v->buf && (!e || v->used < e->used))
+      e = v;
+
+  // adaptive readahead: a miss right where the last fetch ended is taken to
+  // be a sequential scan, and gets twice as much as last time
+  if (off == f->ra_next && f->ra_size)
+    f->ra_size = MIN(2 * f->ra_size, window);
+  else
+    f->ra_size = MIN(BCACHE_MIN_FETCH, window);
+
+  off_t start = off & ~(off_t)(RISCV_PGSIZE - 1);
+  ssize_t ret = host_pread(f, e->buf, f->ra_size, start);
+  if (ret < 0) {
+    e->kfd = -1;
+    *err = ret;
+    return NULL;
+  }
+
+  e->kfd = f->kfd;
+  e->off = start;
+  e->len = ret;
+  f->ra_next = start + ret;
+  return e;
+}
+
+//MWG: pread through the cache. Reads larger than a window, and reads from a
+//trap that interrupted one (e.g. a DUE report), go to the host directly.
+ssize_t bcache_pread(file_t* f, void* buf, size_t n, off_t off)
+{
+  if (n > window || spinlock_trylock(&bcache_lock) != 0)
+    return host_pread(f, buf, n, off);
+
+  ssize_t ret = 0, err = 0;
+  while (n > 0)
+  {
+    bcache_lookups++;
+    bcache_entry_t* e = bcache_lookup(f->kfd, off);
+    if (e)
+      bcache_hits++;
+    else if (!(e = bcache_fill(f, off, &err)))
+      break;
+    e->used = ++bcache_clock;
+
+    size_t avail = e->off + e->len > off ? e->off + e->len - off : 0;
+    size_t chunk = MIN(n, avail);
+    if (chunk == 0)
+      break; // EOF
+    memcpy(buf, e->buf + (off - e->off), chunk);
+    buf += chunk;
+    off += chunk;
+    n -= chunk;
+    ret += chunk;
+  }
+
+  spinlock_unlock(&bcache_lock);
+  return ret ? ret : err;
+}
+
+//MWG: Drops everything cached for host fd kfd, or for all files if kfd < 0.
+void bcache_invalidate(int kfd)
+{
+  if (!window)
+    return;
+  spinlock_lock(&bcache_lock);
+  for (bcache_entry_t* e = entries; e < entries + BCACHE_WAYS; e++)
+    if (kfd < 0 || e->kfd == kfd)
+      e->kfd = -1;
+  spinlock_unlock(&bcache_lock);
+}
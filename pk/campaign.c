@@ -0,0 +1,106 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// Multi-trial campaigns (-n<N>): run the same program N times in one pk
+// session. When a trial exits, its outcome is recorded, the user address
+// space is torn down and the ELF is mapped again. The new trial starts from
+// the same post-load state as the first: file-backed pages are faulted back
+// in from the ELF on demand, so only what a trial touches is ever copied.
+// After the last trial, one summary line per trial is printed.
+
+#include "pk.h"
+#include "vm.h"
+#include "file.h"
+#include "atomic.h"
+#include <string.h>
+
+typedef struct {
+  int code;
+  long dues;
+  long dues_correct;
+  uint64_t output_digest;
+} trial_outcome_t;
+
+long campaign_trials = 0; //MWG: -n
+static long trial;
+static trial_outcome_t* outcomes;
+static long dues_at_start, dues_correct_at_start;
+
+// argv as the first trial got it, with the strings copied out of the boot
+// stack; each trial gets a scratch copy, since the loader overwrites argv[]
+static struct mainvars* pristine_args;
+static struct mainvars* trial_args;
+static long* trial_phdrs;
+#define TRIAL_PHDRS_SIZE 1024
+
+static void start_trial()
+{
+  g_output_digest = FNV_OFFSET_BASIS;
+  dues_at_start = g_dues_reported;
+  dues_correct_at_start = g_dues_correct;
+}
+
+//MWG: called by run_loaded_program() before the first trial starts
+void campaign_init(struct mainvars* args)
+{
+  size_t npage = ROUNDUP(campaign_trials * sizeof(trial_outcome_t), RISCV_PGSIZE) / RISCV_PGSIZE;
+  outcomes = (trial_outcome_t*)kernel_page_alloc(npage);
+  uintptr_t buf = kernel_page_alloc(1);
+  if (!outcomes || !buf)
+    panic("not enough memory for %ld trials", campaign_trials);
+
+  pristine_args = (struct mainvars*)buf;
+  trial_args = (struct mainvars*)(buf + sizeof(struct mainvars));
+  trial_phdrs = (long*)(buf + 2*sizeof(struct mainvars));
+  kassert(2*sizeof(struct mainvars) + TRIAL_PHDRS_SIZE <= RISCV_PGSIZE);
+
+  char* p = (char*)&pristine_args->argv[args->argc];
+  pristine_args->argc = args->argc;
+  for (size_t i = 0; i < args->argc; i++) {
+    size_t len = strlen((char*)(uintptr_t)args->argv[i]) + 1;
+    memcpy(p, (char*)(uintptr_t)args->argv[i], len);
+    pristine_args->argv[i] = (uintptr_t)p;
+    p += len;
+  }
+
+  start_trial();
+}
+
+static void print_summary()
+{
+  printk("pk: campaign summary, %ld trials\n", campaign_trials);
+  for (long i = 0; i < campaign_trials; i++)
+    printk("pk: trial %ld: exit %d, %ld DUEs, %ld correct, output digest %lx\n",
+           i, outcomes[i].code, outcomes[i].dues, outcomes[i].dues_correct, outcomes[i].output_digest);
+}
+
+//MWG: Called by sys_exit(). Starts the next trial, if there is one; returns
+//once the last trial has exited.
+void campaign_exit(int code)
+{
+  outcomes[trial].code = code;
+  outcomes[trial].dues = g_dues_reported - dues_at_start;
+  outcomes[trial].dues_correct = g_dues_correct - dues_correct_at_start;
+  outcomes[trial].output_digest = g_output_digest;
+
+  if (++trial == campaign_trials) {
+    print_summary();
+    return;
+  }
+
+  for (int fd = 3; fd < MAX_FDS; fd++)
+    fd_close(fd);
+  vm_reset_user();
+
+  memcpy(trial_args, pristine_args, sizeof(*trial_args));
+  current.phdr = (uintptr_t)trial_phdrs;
+  current.phdr_size = TRIAL_PHDRS_SIZE;
+  load_elf((char*)(uintptr_t)trial_args->argv[0], &current);
+
+  start_trial();
+  rerun_loaded_program(trial_args);
+}
@@ -0,0 +1,102 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// Checkpoint/restore of the user process, so that fault-injection campaigns
+// don't pay for booting and warming up the same program over and over. The
+// program marks the point to save with the checkpoint syscall; a later run
+// started with -r<file> resumes right after that syscall.
+//
+// The image is a header (the process' elf_info, trapframe and FP state)
+// followed by the address space, as written by vm_checkpoint(). Only the
+// standard streams are valid after a restore; other open files are not saved.
+
+#include "pk.h"
+#include "vm.h"
+#include "file.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#define CHECKPOINT_MAGIC 0x706b636b70740001ULL
+
+typedef struct {
+  uint64_t magic;
+  uint64_t mem_size;
+  uint64_t header_size;
+  elf_info current;
+  trapframe_t tf;
+  unsigned long fpr[NUM_FPR];
+  unsigned long fcsr;
+} checkpoint_header_t;
+
+static checkpoint_header_t restored;
+
+//MWG: Returns 0 to the caller once the checkpoint is written; the restored
+//process returns from the same syscall with 1.
+long sys_checkpoint(trapframe_t* tf, const char* path)
+{
+  file_t* f = file_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (IS_ERR_VALUE(f))
+    return PTR_ERR(f);
+
+  checkpoint_header_t* h = &restored; // not in use until a restore
+  memset(h, 0, sizeof(*h));
+  h->magic = CHECKPOINT_MAGIC;
+  h->mem_size = mem_size;
+  h->header_size = sizeof(*h);
+  h->current = current;
+  copy_trapframe(&h->tf, tf);
+  h->tf.gpr[10] = 1;
+  h->tf.epc += 4;
+  for (size_t i = 0; i < NUM_FPR; i++)
+    get_float_register(i, &h->fpr[i]);
+  h->fcsr = read_csr(fcsr);
+
+  long ret = 0;
+  if (file_pwrite(f, h, sizeof(*h), 0) != sizeof(*h) || vm_checkpoint(f, sizeof(*h)) != 0)
+    ret = -EIO;
+
+  file_decref(f);
+  if (ret == 0)
+    printk("pk: checkpoint written to %s\n", path);
+  return ret;
+}
+
+//MWG: Reads the header of a checkpoint and restores the process' elf_info,
+//which pk_vm_init() needs. The rest is restored by checkpoint_restore().
+file_t* checkpoint_open(const char* path)
+{
+  file_t* f = file_open(path, O_RDONLY, 0);
+  if (IS_ERR_VALUE(f))
+    panic("couldn't open checkpoint: %s!", path);
+
+  if (file_pread(f, &restored, sizeof(restored), 0) != sizeof(restored)
+      || restored.magic != CHECKPOINT_MAGIC || restored.header_size != sizeof(restored))
+    panic("bad checkpoint: %s!", path);
+  if (restored.mem_size != mem_size)
+    panic("checkpoint %s was taken with %ld bytes of memory, not %ld!", path, restored.mem_size, mem_size);
+
+  size_t t0 = current.t0; // -s applies to this run
+  current = restored.current;
+  current.t0 = t0;
+  return f;
+}
+
+//MWG: Must run in supervisor mode, after pk_vm_init().
+void checkpoint_restore(file_t* f, trapframe_t* tf)
+{
+  if (vm_restore(f, sizeof(restored)) != 0)
+    panic("couldn't restore the address space from the checkpoint!");
+  file_decref(f);
+
+  for (size_t i = 0; i < NUM_FPR; i++)
+    set_float_register(i, restored.fpr[i]);
+  write_csr(fcsr, restored.fcsr);
+
+  copy_trapframe(tf, &restored.tf);
+  tf->status = read_csr(sstatus);
+}
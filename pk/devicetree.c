@@ -57,6 +57,8 @@ static uint32_t* parse_node(uint32_t* token, char* strings)
         dev_type = (char*)token;
       } else if (strcmp(name, "isa") == 0) {
         isa = (char*)token;
+      } else if (strcmp(name, "timebase-frequency") == 0) { //MWG
+        timebase_freq = len == 8 ? fdt_read_uint64(token) : ntohl(*token);
       } else if (strcmp(name, "reg") == 0) {
         reg_len = len;
         reg_addr = token;
@@ -0,0 +1,259 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+#include "pk.h"
+#include "vm.h"
+#include "softfloat.h"
+#include "insn_table.h"
+
+//MWG: An instruction is legal if it matches one of the DECLARE_INSN patterns in
+//encoding.h. insn_table.h has them precomputed (see scripts/gen-insn-table.py),
+//so a check is a few table lookups, plus a scan of the handful of privileged
+//SYSTEM patterns for instructions that could be one of them. Compressed
+//instructions are passed in the low 16 bits.
+int insn_is_legal(uint32_t insn)
+{
+  if ((insn & 3) != 3)
+    return (insn_compressed[(insn & 0xffff) / 32] >> (insn % 32)) & 1;
+
+  uint8_t major = insn_major[((insn >> 2) & 0x1f) << 3 | ((insn >> 12) & 7)];
+  uint8_t rs2 = insn_funct7[major & ~INSN_TABLE_WIDE][insn >> 25];
+  if ((insn_rs2[rs2] >> ((insn >> 20) & 0x1f)) & 1)
+    return 1;
+
+  if (major & INSN_TABLE_WIDE)
+    for (size_t i = 0; i < ARRAY_SIZE(insn_wide); i++)
+      if ((insn & insn_wide[i].mask) == insn_wide[i].match)
+        return 1;
+  return 0;
+}
+
+//MWG: Decode the instructions in msg, starting at the demand fetch (offset
+//bytes into the message, which is the only instruction boundary we know
+//of) and using the neighboring cacheline words for parcels that spill over.
+//Returns 0 if any of them is illegal.
+static int message_insns_legal(word_t* msg, due_cacheline_t* cl, int offset)
+{
+  int n = (int)msg->size;
+  unsigned char buf[3*MAX_WORD_SIZE];
+  int start = n, end = 2*n;
+
+  memcpy(buf+n, msg->bytes, n);
+  if (cl->blockpos > 0 && cl->blockpos <= cl->size) {
+    memcpy(buf, cl->words[cl->blockpos-1].bytes, n);
+    start = 0;
+  }
+  if (cl->blockpos+1 < cl->size) {
+    memcpy(buf+2*n, cl->words[cl->blockpos+1].bytes, n);
+    end = 3*n;
+  }
+
+  int pos = n + offset;
+  if (pos < start)
+    return 1;
+
+  while (pos < 2*n && pos+2 <= end) {
+    uint32_t insn = buf[pos] | (buf[pos+1] << 8);
+    if ((insn & 3) != 3) {
+      pos += 2;
+    } else if (pos+4 <= end) {
+      insn |= (uint32_t)(buf[pos+2] | (buf[pos+3] << 8)) << 16;
+      pos += 4;
+    } else {
+      break;
+    }
+    if (!insn_is_legal(insn))
+      return 0;
+  }
+  return 1;
+}
+
+//MWG: For instruction-memory DUEs, drop the candidates that decode to an
+//illegal instruction, keeping the survivors in their original order. If
+//none of them is legal, the candidates are left alone. Returns the number of
+//candidates dropped.
+int filter_illegal_insn_candidates(due_candidates_t* candidates, due_cacheline_t* cl, int offset)
+{
+  char legal[MAX_CANDIDATE_MSG];
+  size_t nlegal = 0;
+
+  for (size_t i = 0; i < candidates->size; i++)
+    nlegal += legal[i] = message_insns_legal(candidates->candidate_messages+i, cl, offset);
+
+  if (nlegal == 0 || nlegal == candidates->size)
+    return 0;
+
+  size_t n = 0;
+  for (size_t i = 0; i < candidates->size; i++)
+    if (legal[i])
+      copy_word(candidates->candidate_messages+(n++), candidates->candidate_messages+i);
+
+  int dropped = candidates->size - n;
+  candidates->size = n;
+  return dropped;
+}
+
+//MWG
+static int word_looks_like_pointer(word_t* w)
+{
+  uintptr_t val = 0;
+  if (w->size != sizeof(val))
+    return 0;
+  memcpy(&val, w->bytes, sizeof(val));
+  return val != 0 && vaddr_is_mapped(val);
+}
+
+//MWG: For 8-byte data DUEs in a cacheline whose other words are mostly
+//pointers, move the candidates that don't point into a mapped user region
+//behind the ones that do, keeping the order within each group. Nothing is
+//dropped: a non-pointer may still be the right answer. Returns 1 if the
+//order changed.
+int demote_non_pointer_candidates(due_candidates_t* candidates, due_cacheline_t* cl)
+{
+  if (candidates->size < 2 || candidates->candidate_messages[0].size != sizeof(uintptr_t))
+    return 0;
+
+  size_t others = 0, pointers = 0;
+  for (size_t i = 0; i < cl->size; i++) {
+    if (i == cl->blockpos || cl->words[i].size != sizeof(uintptr_t))
+      continue;
+    others++;
+    pointers += word_looks_like_pointer(cl->words+i);
+  }
+  if (others == 0 || 2*pointers < others)
+    return 0;
+
+  int changed = 0;
+  size_t k = 0;
+  for (size_t i = 0; i < candidates->size; i++) {
+    if (!word_looks_like_pointer(candidates->candidate_messages+i))
+      continue;
+    if (i != k) {
+      word_t w;
+      copy_word(&w, candidates->candidate_messages+i);
+      for (size_t j = i; j > k; j--)
+        copy_word(candidates->candidate_messages+j, candidates->candidate_messages+j-1);
+      copy_word(candidates->candidate_messages+k, &w);
+      changed = 1;
+    }
+    k++;
+  }
+  return changed;
+}
+
+// Penalties for FP values that are unlikely to be what the program stored.
+// Normal values are penalized by their exponent distance from the normal
+// values around them instead.
+#define FP_PENALTY_NAN (1 << 16)
+#define FP_PENALTY_INF (1 << 15)
+#define FP_PENALTY_SUBNORMAL (1 << 14)
+#define FP_PENALTY_ZERO 16
+#define FP_RANK_MARGIN 8
+
+//MWG: returns the biased exponent and the softfloat class of a 4- or 8-byte value
+static long fp_exponent(const unsigned char* bytes, size_t size, uint_fast16_t* cls)
+{
+  if (size == 4) {
+    float32_t f;
+    memcpy(&f, bytes, sizeof(f));
+    *cls = f32_classify(f);
+    return (f >> 23) & 0xff;
+  }
+  float64_t f;
+  memcpy(&f, bytes, sizeof(f));
+  *cls = f64_classify(f);
+  return (f >> 52) & 0x7ff;
+}
+
+//MWG
+static long fp_penalty(const unsigned char* bytes, size_t size, long ref_exp)
+{
+  uint_fast16_t cls;
+  long exp = fp_exponent(bytes, size, &cls);
+
+  if (cls & 0x300) // signaling or quiet NaN
+    return FP_PENALTY_NAN;
+  if (cls & 0x81) // +/- infinity
+    return FP_PENALTY_INF;
+  if (cls & 0x24) // +/- subnormal
+    return FP_PENALTY_SUBNORMAL;
+  if (cls & 0x18) // +/- zero
+    return FP_PENALTY_ZERO;
+  if (ref_exp < 0)
+    return 0;
+  return exp > ref_exp ? exp - ref_exp : ref_exp - exp;
+}
+
+//MWG: For FP loads, sort the candidates by how plausible the loaded value
+//is as a float/double next to the other FP values in the cacheline (stable,
+//most plausible first). Returns 1 if the ranking is decisive, i.e. the best
+//candidate beats the runner-up by a clear margin, in which case it can
+//stand in for the system policy.
+int rank_fp_candidates(due_candidates_t* candidates, due_cacheline_t* cl, size_t load_size, int offset)
+{
+  if ((load_size != 4 && load_size != 8) || candidates->size < 2)
+    return 0;
+
+  // reference exponent: the mean over normal values in the other words
+  long exp_sum = 0, nexp = 0;
+  for (size_t i = 0; i < cl->size; i++) {
+    if (i == cl->blockpos)
+      continue;
+    for (size_t j = 0; j + load_size <= cl->words[i].size; j += load_size) {
+      uint_fast16_t cls;
+      long exp = fp_exponent(cl->words[i].bytes + j, load_size, &cls);
+      if (cls & 0x42) {
+        exp_sum += exp;
+        nexp++;
+      }
+    }
+  }
+  long ref_exp = nexp ? exp_sum / nexp : -1;
+
+  long penalty[MAX_CANDIDATE_MSG];
+  for (size_t i = 0; i < candidates->size; i++) {
+    word_t value;
+    if (load_value_from_message(candidates->candidate_messages+i, &value, cl, load_size, offset) != 0)
+      return 0;
+    penalty[i] = fp_penalty(value.bytes, load_size, ref_exp);
+  }
+
+  for (size_t i = 1; i < candidates->size; i++) {
+    long p = penalty[i];
+    word_t w;
+    copy_word(&w, candidates->candidate_messages+i);
+    size_t j = i;
+    for ( ; j > 0 && penalty[j-1] > p; j--) {
+      penalty[j] = penalty[j-1];
+      copy_word(candidates->candidate_messages+j, candidates->candidate_messages+j-1);
+    }
+    penalty[j] = p;
+    copy_word(candidates->candidate_messages+j, &w);
+  }
+
+  return penalty[1] - penalty[0] >= FP_RANK_MARGIN;
+}
+
+//MWG: Inverse of parse_sdecc_candidate_output(), i.e. comma-separated binary
+//messages, so that filtered candidate sets can be handed to custom3.
+void serialize_sdecc_candidates(char* cstring, size_t len, due_candidates_t* candidates)
+{
+  size_t k = 0;
+  for (size_t c = 0; c < candidates->size; c++) {
+    word_t* w = candidates->candidate_messages+c;
+    if (k + 8*w->size + 1 > len)
+      break;
+    if (c > 0)
+      cstring[k-1] = ',';
+    for (size_t i = 0; i < w->size; i++)
+      for (size_t j = 0; j < 8; j++)
+        cstring[k++] = (w->bytes[i] & (1 << (8-j-1))) ? '1' : '0';
+    cstring[k++] = '\0';
+  }
+  if (k == 0 && len > 0)
+    cstring[0] = '\0';
+}
@@ -0,0 +1,407 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// Software DUE injection, for exercising the recovery path on simulators
+// that neither raise CAUSE_MEMORY_DUE nor implement the penalty box.
+//
+// An armed word's page has its user access revoked. The first user load
+// or fetch that touches the armed cacheline is turned into a synthetic DUE:
+// the penalty box CSRs, candidate generation (custom2) and the system
+// recovery policy (custom3) are all emulated here, and handle_memory_due()
+// runs as it would for a real one. Other loads and stores to the page are
+// emulated. Anything we can't emulate (compressed or atomic accesses,
+// fetches outside the line) and stores that overwrite the armed word
+// disarm it instead.
+
+#include "pk.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SW_DUE_MAX_TARGETS 16
+#define SW_DUE_MSG_SIZE 8
+#define SW_DUE_CACHELINE_SIZE 64
+#define SW_DUE_CACHELINE_WORDS (SW_DUE_CACHELINE_SIZE / SW_DUE_MSG_SIZE)
+#define SW_DUE_NUM_CANDIDATES 12
+
+typedef struct {
+  uintptr_t addr; // message-aligned
+  pte_t pte;      // user PTE of the page before it was revoked
+} sw_due_target_t;
+
+typedef struct {
+  size_t load_size;
+  int mem_type;
+  size_t blockpos;
+  uint64_t line[SW_DUE_CACHELINE_WORDS];
+  uint64_t cheat_msg;
+  uint64_t candidates[SW_DUE_NUM_CANDIDATES];
+  size_t line_reads;
+  size_t cheat_line_reads;
+} sw_penalty_box_t;
+
+int g_sw_due = 0; //MWG: -j or -J given
+long g_sw_due_period = 0; //MWG: -J, arm a random word every this many user traps
+long g_sw_due_injected = 0; //MWG
+static long sw_due_ticks;
+static sw_due_target_t sw_due_targets[SW_DUE_MAX_TARGETS];
+static size_t sw_due_ntargets;
+static uintptr_t sw_due_requested[SW_DUE_MAX_TARGETS]; // -j addresses, armed once the program is loaded
+static size_t sw_due_nrequested;
+static sw_penalty_box_t sw_pb;
+static uint64_t sw_due_rng = 0x9e3779b97f4a7c15ULL;
+
+//MWG: xorshift64
+static uint64_t sw_due_rand()
+{
+  sw_due_rng ^= sw_due_rng << 13;
+  sw_due_rng ^= sw_due_rng >> 7;
+  sw_due_rng ^= sw_due_rng << 17;
+  return sw_due_rng;
+}
+
+//MWG: a random error pattern with two distinct bits set
+static uint64_t sw_due_rand_2bit()
+{
+  size_t a = sw_due_rand() % 64, b;
+  do
+    b = sw_due_rand() % 64;
+  while (b == a);
+  return (1ULL << a) | (1ULL << b);
+}
+
+//MWG: decimal, or hex with a 0x prefix
+static uintptr_t parse_addr(const char* s)
+{
+  if (s[0] != '0' || (s[1] != 'x' && s[1] != 'X'))
+    return atol(s);
+
+  uintptr_t res = 0;
+  for (s += 2; *s; s++) {
+    int d = (*s >= '0' && *s <= '9') ? *s - '0'
+          : (*s >= 'a' && *s <= 'f') ? *s - 'a' + 10
+          : (*s >= 'A' && *s <= 'F') ? *s - 'A' + 10 : -1;
+    if (d < 0)
+      break;
+    res = res * 16 + d;
+  }
+  return res;
+}
+
+//MWG: -j<addr>
+void sw_due_request(const char* addr)
+{
+  if (sw_due_nrequested == SW_DUE_MAX_TARGETS)
+    panic("too many DUE injection targets");
+  sw_due_requested[sw_due_nrequested++] = parse_addr(addr);
+  g_sw_due = 1;
+}
+
+//MWG: -J<N>
+void sw_due_set_period(const char* period)
+{
+  g_sw_due_period = atol(period);
+  if (g_sw_due_period <= 0)
+    panic("bad DUE injection period: `%s'", period);
+  g_sw_due = 1;
+}
+
+static sw_due_target_t* sw_due_find(uintptr_t addr, uintptr_t granularity)
+{
+  for (size_t i = 0; i < sw_due_ntargets; i++)
+    if (ROUNDDOWN(sw_due_targets[i].addr, granularity) == ROUNDDOWN(addr, granularity))
+      return &sw_due_targets[i];
+  return NULL;
+}
+
+//MWG: returns 0 if the word is armed
+static int sw_due_arm(uintptr_t addr)
+{
+  addr &= -SW_DUE_MSG_SIZE;
+  if (sw_due_ntargets == SW_DUE_MAX_TARGETS || sw_due_find(addr, SW_DUE_MSG_SIZE))
+    return -1;
+
+  sw_due_target_t* same_page = sw_due_find(addr, RISCV_PGSIZE);
+  pte_t pte = same_page ? same_page->pte : revoke_user_page(addr);
+  if (!pte)
+    return -1;
+
+  sw_due_targets[sw_due_ntargets].addr = addr;
+  sw_due_targets[sw_due_ntargets].pte = pte;
+  sw_due_ntargets++;
+  return 0;
+}
+
+static void sw_due_disarm(sw_due_target_t* t)
+{
+  uintptr_t addr = t->addr;
+  pte_t pte = t->pte;
+  *t = sw_due_targets[--sw_due_ntargets];
+  if (!sw_due_find(addr, RISCV_PGSIZE))
+    restore_user_page(addr, pte);
+}
+
+//MWG: Drops the targets in [addr, addr+len), which is being unmapped. The
+//caller holds vm_lock and is tearing down the PTEs, so nothing is restored.
+void sw_due_forget(uintptr_t addr, size_t len)
+{
+  for (size_t i = 0; i < sw_due_ntargets; )
+    if (sw_due_targets[i].addr >= addr && sw_due_targets[i].addr < addr + len)
+      sw_due_targets[i] = sw_due_targets[--sw_due_ntargets];
+    else
+      i++;
+}
+
+//MWG: called once the program is loaded, and again for every campaign trial
+void sw_due_init()
+{
+  if (!g_sw_due)
+    return;
+
+  // a new campaign trial: the old targets went away with the address space
+  sw_due_ntargets = 0;
+  sw_due_ticks = 0;
+
+  for (size_t i = 0; i < sw_due_nrequested; i++) {
+    // the page may not be resident yet
+    if (handle_page_fault(sw_due_requested[i], PROT_READ) != 0 || sw_due_arm(sw_due_requested[i]) != 0)
+      panic("can't inject a DUE at %p", sw_due_requested[i]);
+  }
+}
+
+//MWG: Called on every syscall and page fault. With -J, a random word of a
+//random resident user page is armed every g_sw_due_period calls.
+void sw_due_tick()
+{
+  if (!g_sw_due_period || ++sw_due_ticks < g_sw_due_period)
+    return;
+  sw_due_ticks = 0;
+
+  uintptr_t lo = current.first_user_vaddr, hi = current.stack_top;
+  if (hi <= lo)
+    return;
+  uintptr_t page = next_resident_page(lo + sw_due_rand() % (hi - lo), hi);
+  if (!page)
+    page = next_resident_page(lo, hi);
+  if (page)
+    sw_due_arm(page + sw_due_rand() % RISCV_PGSIZE);
+}
+
+//MWG
+uintptr_t sw_penalty_box_read(int csr)
+{
+  switch (csr) {
+    case CSR_PENALTY_BOX_LOAD_SIZE:
+      return sw_pb.load_size;
+    case CSR_PENALTY_BOX_MSG_SIZE:
+      return SW_DUE_MSG_SIZE;
+    case CSR_PENALTY_BOX_CACHELINE_SIZE:
+      return SW_DUE_CACHELINE_SIZE;
+    case CSR_PENALTY_BOX_CACHELINE_BLKPOS:
+      return sw_pb.blockpos;
+    case CSR_PENALTY_BOX_CACHELINE_WORD:
+      return sw_pb.line[sw_pb.line_reads++ % SW_DUE_CACHELINE_WORDS];
+    case CSR_PENALTY_BOX_MEM_TYPE:
+      return sw_pb.mem_type;
+    case CSR_PENALTY_BOX_CACHELINE_DUE_MASK:
+      return 1UL << sw_pb.blockpos;
+    case CSR_PENALTY_BOX_CHEAT_MSG:
+      return sw_pb.cheat_msg;
+    case CSR_PENALTY_BOX_CHEAT_CACHELINE_WORD: {
+      size_t i = sw_pb.cheat_line_reads++ % SW_DUE_CACHELINE_WORDS;
+      return i == sw_pb.blockpos ? sw_pb.cheat_msg : sw_pb.line[i];
+    }
+    default:
+      return 0;
+  }
+}
+
+//MWG: one message per line, most significant bit of each byte first, like the real hook
+static size_t sw_due_format_message(char* out, uint64_t msg)
+{
+  unsigned char* bytes = (unsigned char*)&msg;
+  size_t k = 0;
+  for (size_t i = 0; i < SW_DUE_MSG_SIZE; i++)
+    for (size_t j = 0; j < 8; j++)
+      out[k++] = (bytes[i] & (1 << (8-j-1))) ? '1' : '0';
+  return k;
+}
+
+//MWG: stands in for custom2
+void sw_due_candidates(char* cstring, size_t len)
+{
+  size_t k = 0;
+  for (size_t i = 0; i < SW_DUE_NUM_CANDIDATES && k + 8*SW_DUE_MSG_SIZE + 2 <= len; i++) {
+    k += sw_due_format_message(cstring + k, sw_pb.candidates[i]);
+    cstring[k++] = '\n';
+  }
+  cstring[k] = '\0';
+}
+
+//MWG: Stands in for custom3. Picks the candidate that shares the most bytes
+//with the other words of the cacheline, in the same byte positions; ties go
+//to the earliest candidate. Candidates come comma-separated, as custom3
+//gets them.
+void sw_due_recover(char* out, size_t len, const char* candidates_cstring)
+{
+  const char* best = candidates_cstring;
+  long best_score = -1;
+
+  for (const char* c = candidates_cstring; *c; c += 8*SW_DUE_MSG_SIZE + (c[8*SW_DUE_MSG_SIZE] == ',')) {
+    uint64_t msg = 0;
+    unsigned char* bytes = (unsigned char*)&msg;
+    for (size_t i = 0; i < 8*SW_DUE_MSG_SIZE; i++)
+      bytes[i/8] |= (c[i] == '1') << (8-(i%8)-1);
+
+    long score = 0;
+    for (size_t i = 0; i < SW_DUE_CACHELINE_WORDS; i++) {
+      if (i == sw_pb.blockpos)
+        continue;
+      unsigned char* neighbor = (unsigned char*)&sw_pb.line[i];
+      for (size_t j = 0; j < SW_DUE_MSG_SIZE; j++)
+        score += bytes[j] == neighbor[j];
+    }
+    if (score > best_score) {
+      best_score = score;
+      best = c;
+    }
+  }
+
+  if (len > 8*SW_DUE_MSG_SIZE) {
+    memcpy(out, best, 8*SW_DUE_MSG_SIZE);
+    out[8*SW_DUE_MSG_SIZE] = '\0';
+  }
+}
+
+//MWG: raise a synthetic DUE on the armed word t, for the access that trapped in tf
+static void sw_due_inject(trapframe_t* tf, sw_due_target_t* t, int mem_type, size_t load_size)
+{
+  uintptr_t t_addr = t->addr;
+  uintptr_t line = ROUNDDOWN(t_addr, SW_DUE_CACHELINE_SIZE);
+  memcpy(sw_pb.line, (void*)line, SW_DUE_CACHELINE_SIZE);
+  sw_pb.blockpos = (t_addr - line) / SW_DUE_MSG_SIZE;
+  sw_pb.cheat_msg = sw_pb.line[sw_pb.blockpos];
+  sw_pb.load_size = load_size;
+  sw_pb.mem_type = mem_type;
+  sw_pb.line_reads = 0;
+  sw_pb.cheat_line_reads = 0;
+
+  // Corrupt two bits. The candidates are the received word with the true
+  // error pattern undone, plus other two-bit patterns as decoys.
+  uint64_t error = sw_due_rand_2bit();
+  uint64_t received = sw_pb.cheat_msg ^ error;
+  size_t truth = sw_due_rand() % SW_DUE_NUM_CANDIDATES;
+  for (size_t i = 0; i < SW_DUE_NUM_CANDIDATES; i++) {
+    uint64_t e = error;
+    if (i != truth) {
+      int fresh;
+      do {
+        e = sw_due_rand_2bit();
+        fresh = e != error;
+        for (size_t j = 0; j < i; j++)
+          fresh &= (received ^ e) != sw_pb.candidates[j];
+      } while (!fresh);
+    }
+    sw_pb.candidates[i] = received ^ e;
+  }
+  sw_pb.line[sw_pb.blockpos] = received;
+
+  sw_due_disarm(t);
+  g_sw_due_injected++;
+
+  trapframe_t due_tf;
+  copy_trapframe(&due_tf, tf);
+  due_tf.cause = CAUSE_MEMORY_DUE;
+  due_tf.badvaddr = t_addr;
+  handle_memory_due(&due_tf);
+  copy_trapframe(tf, &due_tf);
+}
+
+//MWG: Loads and stores elsewhere on an armed page are carried out here,
+//since the page is off limits to the user. Returns 0 if emulated.
+static int sw_due_emulate(trapframe_t* tf, uintptr_t addr, int store)
+{
+  uint32_t insn = tf->insn;
+  size_t size = 1 << ((insn >> 12) & 3);
+  int fp = (insn & 0x7f) == (store ? 0x27 : 0x07);
+  size_t reg = store ? (insn >> 20) & 0x1f : decode_rd(insn);
+
+  if (store) {
+    unsigned long val = tf->gpr[reg];
+    if (fp && get_float_register(reg, &val) != 0)
+      return -1;
+    memcpy((void*)addr, &val, size);
+  } else {
+    unsigned long val = 0;
+    memcpy(&val, (void*)addr, size);
+    if (fp) {
+      if (set_float_register(reg, val) != 0)
+        return -1;
+    } else {
+      if (!(insn & 0x4000) && size < sizeof(long)) // lb, lh, lw sign-extend
+        val = (long)(val << (8*(sizeof(long)-size))) >> (8*(sizeof(long)-size));
+      if (reg != 0)
+        tf->gpr[reg] = val;
+    }
+  }
+  tf->epc += 4;
+  return 0;
+}
+
+//MWG: Called on user page faults before the regular handler. Returns 0 if
+//the fault was on an armed page and has been dealt with.
+int sw_due_fault(trapframe_t* tf, int prot)
+{
+  if (!g_sw_due)
+    return -1;
+
+  uintptr_t addr = tf->badvaddr;
+  sw_due_target_t* t = sw_due_find(addr, RISCV_PGSIZE);
+  if (!t)
+    return -1;
+
+  if (prot == PROT_EXEC) {
+    t = sw_due_find(addr, SW_DUE_CACHELINE_SIZE);
+    if (t)
+      sw_due_inject(tf, t, 1, insn_len(tf->insn));
+    else
+      while ((t = sw_due_find(addr, RISCV_PGSIZE)))
+        sw_due_disarm(t);
+    return 0;
+  }
+
+  // the access would have faulted anyway: let the regular handler deal with it
+  if (!(prot == PROT_WRITE ? PTE_UW(t->pte) : PTE_UR(t->pte)))
+    return -1;
+
+  uint32_t insn = tf->insn;
+  int opcode = insn & 0x7f;
+  int store = prot == PROT_WRITE;
+  int emulable = store ? (opcode == 0x23 || opcode == 0x27) : (opcode == 0x03 || opcode == 0x07);
+  size_t size = 1 << ((insn >> 12) & 3);
+
+  if (!emulable) {
+    // compressed or atomic access: give up on the whole page
+    while ((t = sw_due_find(addr, RISCV_PGSIZE)))
+      sw_due_disarm(t);
+    return 0;
+  }
+
+  if (!store && (t = sw_due_find(addr, SW_DUE_CACHELINE_SIZE))) {
+    sw_due_inject(tf, t, 0, size);
+    return 0;
+  }
+
+  // a store that covers the armed word overwrites the error
+  if (store && size == SW_DUE_MSG_SIZE && (t = sw_due_find(addr, SW_DUE_MSG_SIZE)))
+    sw_due_disarm(t);
+
+  if (!sw_due_find(addr, RISCV_PGSIZE))
+    return 0; // the page is accessible again; just retry
+
+  return sw_due_emulate(tf, addr, store);
+}
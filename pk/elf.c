@@ -8,6 +8,8 @@
 #include <elf.h>
 #include <string.h>
 
+int g_preload_elf = 0; //MWG: -e
+
 void load_elf(const char* fn, elf_info* info)
 {
   file_t* file = file_open(fn, O_RDONLY, 0);
@@ -54,7 +56,7 @@ void load_elf(const char* fn, elf_info* info)
     } \
     info->bias = bias; \
     int flags = MAP_FIXED | MAP_PRIVATE; \
-    if (info->is_supervisor) \
+    if (info->is_supervisor || g_preload_elf) \
       flags |= MAP_POPULATE; \
     for (int i = eh->e_phnum - 1; i >= 0; i--) { \
       if(ph[i].p_type == PT_LOAD && ph[i].p_memsz) { \
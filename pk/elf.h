@@ -25,6 +25,7 @@
 #define AT_ENTRY  9
 #define AT_SECURE 23
 #define AT_RANDOM 25
+#define AT_PK_VDSO 0x504b // pk's time page; see vdso.c //MWG
 
 typedef struct {
   uint8_t  e_ident[16];
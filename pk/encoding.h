@@ -632,6 +632,8 @@
 #define CSR_PENALTY_BOX_MEM_TYPE 0x9
 #define CSR_SIM_TICK_COUNTER 0xa
 #define CSR_PENALTY_BOX_CHEAT_MSG 0xb
+#define CSR_PENALTY_BOX_CACHELINE_DUE_MASK 0xc
+#define CSR_PENALTY_BOX_CHEAT_CACHELINE_WORD 0xd
 //End MWG
 #define CSR_CYCLE 0xc00
 #define CSR_TIME 0xc01
@@ -955,6 +957,8 @@ DECLARE_CSR(penaltybox_cacheline_word, CSR_PENALTY_BOX_CACHELINE_WORD)
 DECLARE_CSR(penaltybox_mem_type, CSR_PENALTY_BOX_MEM_TYPE)
 DECLARE_CSR(sim_tick_counter, CSR_SIM_TICK_COUNTER)
 DECLARE_CSR(penaltybox_cheat_msg, CSR_PENALTY_BOX_CHEAT_MSG)
+DECLARE_CSR(penaltybox_cacheline_due_mask, CSR_PENALTY_BOX_CACHELINE_DUE_MASK)
+DECLARE_CSR(penaltybox_cheat_cacheline_word, CSR_PENALTY_BOX_CHEAT_CACHELINE_WORD)
 //End MWG
 DECLARE_CSR(cycle, CSR_CYCLE)
 DECLARE_CSR(time, CSR_TIME)
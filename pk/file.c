@@ -2,53 +2,113 @@
 
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "file.h"
 #include "pk.h"
 #include "frontend.h"
 #include "vm.h"
 
-#define MAX_FDS 128
 static file_t* fds[MAX_FDS];
-#define MAX_FILES 128
+#define MAX_FILES 1024
 file_t files[MAX_FILES] = {[0 ... MAX_FILES-1] = {-1,0}};
 
+//MWG: Free fds and files[] slots are tracked in bitmaps, so allocation finds
+//the lowest free entry (which POSIX requires of fds) a word at a time, and
+//the search starts from the lowest word that may have one.
+#define BITS_PER_WORD (8*sizeof(long))
+typedef struct {
+  unsigned long map[MAX(MAX_FDS, MAX_FILES) / BITS_PER_WORD];
+  unsigned long hint; // lower words are full
+} alloc_bitmap_t;
+
+static alloc_bitmap_t fds_used, files_used;
+
+static long bitmap_claim(alloc_bitmap_t* b, size_t n)
+{
+  unsigned long start = atomic_read(&b->hint);
+  for (size_t w = start; w < n / BITS_PER_WORD; w++) {
+    unsigned long old;
+    while ((old = atomic_read(&b->map[w])) != -1UL) {
+      size_t bit = __builtin_ctzl(~old);
+      if (atomic_cas(&b->map[w], old, old | (1UL << bit)) == old) {
+        atomic_cas(&b->hint, start, w); // unless a release lowered it
+        return w * BITS_PER_WORD + bit;
+      }
+    }
+  }
+  return -1;
+}
+
+static void bitmap_release(alloc_bitmap_t* b, size_t i)
+{
+  size_t w = i / BITS_PER_WORD;
+  unsigned long old;
+  do
+    old = atomic_read(&b->map[w]);
+  while (atomic_cas(&b->map[w], old, old & ~(1UL << (i % BITS_PER_WORD))) != old);
+
+  unsigned long hint;
+  while ((hint = atomic_read(&b->hint)) > w && atomic_cas(&b->hint, hint, w) != hint)
+    ;
+}
+
+//MWG: Write-combining (-w<N>): writes smaller than N bytes are gathered in a
+//per-file buffer and handed to the host together, once the buffer would
+//overflow, or when the file is read, seeked, synced, dup'ed or closed, and
+//at exit. With -W, the console is also flushed at every newline. Reading
+//stdin flushes the console either way, so prompts show up before the input.
+size_t file_wc_size = 0;
+int file_wc_lines = 0;
+
 void file_incref(file_t* f)
 {
   long prev = atomic_add(&f->refcnt, 1);
   kassert(prev > 0);
 }
 
-void file_decref(file_t* f)
+static void dents_drop(file_t* f);
+static void file_wc_free(file_t* f);
+
+//MWG: Returns the first error among the file's outstanding -a writes, if
+//this dropped the last reference, or 0.
+long file_decref(file_t* f)
 {
+  long err = 0;
   if (atomic_add(&f->refcnt, -1) == 2)
   {
     int kfd = f->kfd;
+    dents_drop(f); //MWG
+    file_flush(f); //MWG: -w
+    file_wc_free(f); //MWG: -w
     mb();
     atomic_set(&f->refcnt, 0);
+    bitmap_release(&files_used, f - files); //MWG
 
+    err = frontend_drain(kfd); //MWG: -a
+    bcache_invalidate(kfd); //MWG: -k, the host will reuse kfd
     frontend_syscall(SYS_close, kfd, 0, 0, 0, 0, 0, 0);
   }
+  return err;
 }
 
 static file_t* file_get_free()
 {
-  for (file_t* f = files; f < files + MAX_FILES; f++)
-    if (atomic_read(&f->refcnt) == 0 && atomic_cas(&f->refcnt, 0, 2) == 0)
-      return f;
-  return NULL;
+  long i = bitmap_claim(&files_used, MAX_FILES); //MWG
+  if (i < 0)
+    return NULL;
+  kassert(atomic_cas(&files[i].refcnt, 0, 2) == 0);
+  return &files[i];
 }
 
 int file_dup(file_t* f)
 {
-  for (int i = 0; i < MAX_FDS; i++)
-  {
-    if (atomic_cas(&fds[i], 0, f) == 0)
-    {
-      file_incref(f);
-      return i;
-    }
-  }
-  return -1;
+  file_flush(f); //MWG: -w
+  long i = bitmap_claim(&fds_used, MAX_FDS); //MWG
+  if (i < 0)
+    return -1;
+  file_incref(f);
+  kassert(atomic_cas(&fds[i], 0, f) == 0);
+  return i;
 }
 
 void file_init()
@@ -57,10 +117,59 @@ void file_init()
   for (int i = 0; i < 3; i++) {
     file_t* f = file_get_free();
     f->kfd = i;
+    f->pos = FILE_POS_HOST; //MWG: -k
+    f->stdstream = 1; //MWG: -k, -m
     file_dup(f);
   }
 }
 
+//MWG: Write-combining buffers come from a fixed set of pages, taken from the
+//page pool once it is up, since page tables come from the same small pool.
+//The standard streams get theirs first; other files borrow one when they are
+//opened and give it back when they are closed. A file opened while they are
+//all taken simply isn't buffered.
+#define FILE_WC_BUFS 8
+static char* wc_bufs[FILE_WC_BUFS];
+static unsigned long wc_free; // bit i set if wc_bufs[i] is free
+
+static void file_wc_alloc(file_t* f)
+{
+  unsigned long old;
+  while ((old = atomic_read(&wc_free)) != 0) {
+    size_t i = __builtin_ctzl(old);
+    if (atomic_cas(&wc_free, old, old & ~(1UL << i)) == old) {
+      f->wlen = 0;
+      f->wbuf = wc_bufs[i];
+      return;
+    }
+  }
+}
+
+static void file_wc_free(file_t* f)
+{
+  for (size_t i = 0; i < FILE_WC_BUFS; i++)
+    if (f->wbuf && wc_bufs[i] == f->wbuf) {
+      f->wbuf = NULL;
+      unsigned long old;
+      do
+        old = atomic_read(&wc_free);
+      while (atomic_cas(&wc_free, old, old | (1UL << i)) != old);
+    }
+}
+
+void file_wc_init()
+{
+  if (!file_wc_size)
+    return;
+  if (file_wc_size > RISCV_PGSIZE)
+    file_wc_size = RISCV_PGSIZE;
+  for (size_t i = 0; i < FILE_WC_BUFS; i++)
+    if ((wc_bufs[i] = (char*)kernel_page_alloc(1)))
+      wc_free |= 1UL << i;
+  for (int i = 0; i < 3; i++)
+    file_wc_alloc(files + i);
+}
+
 file_t* file_get(int fd)
 {
   file_t* f;
@@ -89,10 +198,16 @@ file_t* file_openat(int dirfd, const char* fn, int flags, int mode)
     return ERR_PTR(-ENOMEM);
 
   size_t fn_size = strlen(fn)+1;
+  if (flags & (O_CREAT | O_TRUNC)) //MWG: -m
+    statcache_invalidate();
   long ret = frontend_syscall(SYS_openat, dirfd, (long)fn, fn_size, flags, mode, 0, 0);
   if (ret >= 0)
   {
     f->kfd = ret;
+    f->pos = FILE_POS_HOST; //MWG: -k
+    f->stdstream = 0;
+    f->ra_next = f->ra_size = 0;
+    file_wc_alloc(f); //MWG: -w
     return f;
   }
   else
@@ -102,55 +217,262 @@ file_t* file_openat(int dirfd, const char* fn, int flags, int mode)
   }
 }
 
+//MWG: Returns -EBADF, or the error of a failed -a write to the file.
 int fd_close(int fd)
 {
   file_t* f = file_get(fd);
   if (!f)
-    return -1;
+    return -EBADF;
   file_t* old = atomic_cas(&fds[fd], f, 0);
   file_decref(f);
   if (old != f)
-    return -1;
-  file_decref(f);
-  return 0;
+    return -EBADF;
+  bitmap_release(&fds_used, fd); //MWG
+  return file_decref(f);
 }
 
 ssize_t file_read(file_t* f, void* buf, size_t size)
 {
   populate_mapping(buf, size, PROT_WRITE);
+  if (f == stdin) { //MWG: -w
+    file_flush(stdout);
+    file_flush(stderr);
+  }
+  file_flush(f);
+
+  //MWG: -k: once a regular file is read through the cache, pk keeps its file
+  //position; the host's catches up in file_sync_pos().
+  if (bcache_size && f->pos == FILE_POS_HOST) {
+    struct stat st;
+    off_t pos = frontend_syscall(SYS_lseek, f->kfd, 0, SEEK_CUR, 0, 0, 0, 0);
+    if (pos < 0 || frontend_syscall(SYS_fstat, f->kfd, (uintptr_t)&st, 0, 0, 0, 0, 0) != 0
+        || !S_ISREG(st.st_mode))
+      f->pos = FILE_POS_UNCACHED;
+    else
+      f->pos = pos;
+  }
+  if (bcache_size && f->pos >= 0) {
+    ssize_t ret = bcache_pread(f, buf, size, f->pos);
+    if (ret > 0)
+      f->pos += ret;
+    return ret;
+  }
+
   return frontend_syscall(SYS_read, f->kfd, (uintptr_t)buf, size, 0, 0, 0, 0);
 }
 
 ssize_t file_pread(file_t* f, void* buf, size_t size, off_t offset)
 {
   populate_mapping(buf, size, PROT_WRITE);
+  file_flush(f); //MWG: -w
+  if (bcache_size) //MWG: -k
+    return bcache_pread(f, buf, size, offset);
   return frontend_syscall(SYS_pread, f->kfd, (uintptr_t)buf, size, offset, 0, 0, 0);
 }
 
+//MWG: Directory entries are fetched from the host a batch at a time and
+//handed out from this buffer by successive getdents64 calls, which only
+//ever serve one directory: reading another one (or seeking this one) first
+//moves the host's position back to just after the last entry handed out.
+//The stock fesvr doesn't proxy getdents64 and aborts on syscalls it
+//doesn't know, so unless -g says the host does, the program gets -ENOSYS.
+#define DENTS_BUF_SIZE (4 * RISCV_PGSIZE)
+#define DIRENT_OFF(d) (*(int64_t*)((d) + 8))
+#define DIRENT_RECLEN(d) (*(uint16_t*)((d) + 16))
+
+static struct {
+  file_t* f;       // whose entries are buffered, if anyone's
+  char* buf;
+  size_t pos, len; // entries not handed out yet are buf[pos, len)
+  off_t resume;    // host offset after the last entry handed out
+} dents;
+int g_host_getdents = 0; //MWG: -g
+
+static void dents_drop(file_t* f)
+{
+  if (dents.f == f)
+    dents.f = NULL;
+}
+
+static void dents_release(file_t* f)
+{
+  if (dents.f == f && f) {
+    if (dents.pos < dents.len && dents.resume >= 0)
+      frontend_syscall(SYS_lseek, f->kfd, dents.resume, SEEK_SET, 0, 0, 0, 0);
+    dents.f = NULL;
+  }
+}
+
+ssize_t file_getdents(file_t* f, void* buf, size_t size)
+{
+  if (!g_host_getdents)
+    return -ENOSYS;
+
+  populate_mapping(buf, size, PROT_WRITE);
+  if (!dents.buf && !(dents.buf = (char*)kernel_page_alloc(DENTS_BUF_SIZE / RISCV_PGSIZE)))
+    return frontend_syscall(SYS_getdents, f->kfd, (uintptr_t)buf, size, 0, 0, 0, 0);
+
+  if (dents.f != f || dents.pos == dents.len) {
+    // Carrying on with the same directory, the host is where the last
+    // entry handed out said it would be; only a new one needs asking.
+    off_t start = dents.resume;
+    if (dents.f != f) {
+      dents_release(dents.f);
+      start = frontend_syscall(SYS_lseek, f->kfd, 0, SEEK_CUR, 0, 0, 0, 0);
+    }
+    ssize_t ret = frontend_syscall(SYS_getdents, f->kfd, (uintptr_t)dents.buf, DENTS_BUF_SIZE, 0, 0, 0, 0);
+    if (ret <= 0)
+      return ret;
+    dents.f = f;
+    dents.pos = 0;
+    dents.len = ret;
+    dents.resume = start;
+  }
+
+  size_t n = 0;
+  while (dents.pos < dents.len) {
+    char* d = dents.buf + dents.pos;
+    if (n + DIRENT_RECLEN(d) > size)
+      break;
+    memcpy(buf + n, d, DIRENT_RECLEN(d));
+    dents.resume = DIRENT_OFF(d);
+    n += DIRENT_RECLEN(d);
+    dents.pos += DIRENT_RECLEN(d);
+  }
+  return n ? n : -EINVAL; // no room for the next entry
+}
+
+//MWG: -k: moves the host's file position to where cached reads left off,
+//before something that uses it
+static void file_sync_pos(file_t* f)
+{
+  if (f->pos >= 0) {
+    frontend_syscall(SYS_lseek, f->kfd, f->pos, SEEK_SET, 0, 0, 0, 0);
+    f->pos = FILE_POS_HOST;
+  }
+}
+
+//MWG: -k, -m: two host fds may name the same file, so a write drops the
+//whole block cache, and a write can change a file's size and times. This
+//happens when the data reaches the host, i.e. when -w flushes, not when it
+//is buffered. Writes to the standard streams are left out: they are the
+//common case, and nobody reads those back. The host fd number doesn't tell
+//them apart, since the host reuses 0-2 once the program closes them, and
+//neither does the slot in files[], which pk reuses the same way.
+static void file_written(file_t* f)
+{
+  if (!f->stdstream) {
+    bcache_invalidate(-1);
+    statcache_invalidate();
+  }
+}
+
+static ssize_t __file_write(file_t* f, const void* buf, size_t size)
+{
+  file_written(f);
+  if (g_async_writes && frontend_write_async(f->kfd, buf, size) == 0) //MWG: errors show up when the write is reaped
+    return size;
+  return frontend_syscall(SYS_write, f->kfd, (uintptr_t)buf, size, 0, 0, 0, 0);
+}
+
+static void __file_flush(file_t* f)
+{
+  if (f->wlen) {
+    __file_write(f, f->wbuf, f->wlen);
+    f->wlen = 0;
+  }
+}
+
+//MWG: Hands whatever -w has buffered for f to the host.
+int file_flush(file_t* f)
+{
+  if (!f->wbuf)
+    return 0;
+  spinlock_lock(&f->wlock);
+  __file_flush(f);
+  spinlock_unlock(&f->wlock);
+  return 0;
+}
+
+// Like file_flush(), but gives up if f's buffer is in use, which on the way
+// out means that the write using it was interrupted and will never resume.
+static int file_try_flush(file_t* f)
+{
+  if (spinlock_trylock(&f->wlock) != 0)
+    return -1;
+  __file_flush(f);
+  spinlock_unlock(&f->wlock);
+  return 0;
+}
+
+void file_flush_all()
+{
+  long lost = 0;
+  for (file_t* f = files; f < files + MAX_FILES; f++)
+    if (atomic_read(&f->refcnt) > 0 && f->wbuf && file_try_flush(f) != 0)
+      lost += f->wlen;
+
+  if (lost) {
+    printk("pk: %ld bytes of buffered output lost: a write was interrupted\n", lost);
+    if (stderr->wbuf)
+      file_try_flush(stderr);
+  }
+}
+
 ssize_t file_write(file_t* f, const void* buf, size_t size)
 {
   populate_mapping(buf, size, PROT_READ);
-  return frontend_syscall(SYS_write, f->kfd, (uintptr_t)buf, size, 0, 0, 0, 0);
+  file_sync_pos(f); //MWG: -k
+  if (!f->wbuf) //MWG: -w is off, or this file has no buffer
+    return __file_write(f, buf, size);
+
+  // A write from a trap that interrupted a write to the same file (e.g. a
+  // DUE report while the program prints) bypasses the buffer.
+  if (spinlock_trylock(&f->wlock) != 0)
+    return __file_write(f, buf, size);
+
+  ssize_t ret = size; // errors on buffered writes are lost, as with -a
+  if (f->wlen + size > file_wc_size)
+    __file_flush(f);
+  if (size >= file_wc_size)
+    ret = __file_write(f, buf, size);
+  else {
+    memcpy(f->wbuf + f->wlen, buf, size);
+    f->wlen += size;
+    if (file_wc_lines && (f == stdout || f == stderr) && memchr(buf, '\n', size))
+      __file_flush(f);
+  }
+
+  spinlock_unlock(&f->wlock);
+  return ret;
 }
 
 ssize_t file_pwrite(file_t* f, const void* buf, size_t size, off_t offset)
 {
   populate_mapping(buf, size, PROT_READ);
+  file_flush(f); //MWG: -w
+  file_written(f); //MWG: -k
   return frontend_syscall(SYS_pwrite, f->kfd, (uintptr_t)buf, size, offset, 0, 0, 0);
 }
 
 int file_stat(file_t* f, struct stat* s)
 {
   populate_mapping(s, sizeof(*s), PROT_WRITE);
+  file_flush(f); //MWG: -w
   return frontend_syscall(SYS_fstat, f->kfd, (uintptr_t)s, 0, 0, 0, 0, 0);
 }
 
 int file_truncate(file_t* f, off_t len)
 {
+  file_flush(f); //MWG: -w
+  file_written(f); //MWG: -k
   return frontend_syscall(SYS_ftruncate, f->kfd, len, 0, 0, 0, 0, 0);
 }
 
 ssize_t file_lseek(file_t* f, size_t ptr, int dir)
 {
+  file_flush(f); //MWG: -w
+  file_sync_pos(f); //MWG: -k
+  dents_release(f); //MWG
   return frontend_syscall(SYS_lseek, f->kfd, ptr, dir, 0, 0, 0, 0);
 }
@@ -12,8 +12,20 @@ typedef struct file
 {
   int kfd; // file descriptor on the host side of the HTIF
   uint32_t refcnt;
+  spinlock_t wlock; //MWG: -w, guards wbuf and wlen
+  char* wbuf;       // write-combining buffer, one page, if the file has one
+  size_t wlen;
+  off_t pos;        //MWG: -k, file position while reads come from the cache
+  off_t ra_next;    // where the last readahead ended
+  size_t ra_size;   // and how much it fetched
+  int stdstream;    //MWG: one of the standard streams pk started with
 } file_t;
 
+#define FILE_POS_HOST -1     // the host's file position is current
+#define FILE_POS_UNCACHED -2 // not a regular file; reads go to the host
+
+#define MAX_FDS 1024
+
 extern file_t files[];
 #define stdin  (files + 0)
 #define stdout (files + 1)
@@ -21,7 +33,7 @@ extern file_t files[];
 
 file_t* file_get(int fd);
 file_t* file_open(const char* fn, int flags, int mode);
-void file_decref(file_t*);
+long file_decref(file_t*);
 void file_incref(file_t*);
 int file_dup(file_t*);
 
@@ -33,8 +45,32 @@ ssize_t file_read(file_t* f, void* buf, size_t n);
 ssize_t file_lseek(file_t* f, size_t ptr, int dir);
 int file_truncate(file_t* f, off_t len);
 int file_stat(file_t* f, struct stat* s);
+ssize_t file_getdents(file_t* f, void* buf, size_t n); //MWG
 int fd_close(int fd);
+int file_flush(file_t* f); //MWG
+void file_flush_all(); //MWG
 
 void file_init();
+void file_wc_init(); //MWG
+
+void bcache_init(); //MWG
+ssize_t bcache_pread(file_t* f, void* buf, size_t n, off_t off); //MWG
+void bcache_invalidate(int kfd); //MWG
+
+// statcache lookup kinds
+#define STATCACHE_FSTATAT(flags) ((long)(flags) << 2 | 0)
+#define STATCACHE_LSTAT 1
+#define STATCACHE_ACCESS(mode) ((long)(mode) << 2 | 2)
+int statcache_get(long kind, const char* path, void* st, long* ret); //MWG
+void statcache_put(long kind, const char* path, const void* st, long ret); //MWG
+void statcache_invalidate(); //MWG
+
+extern size_t file_wc_size; //MWG: -w
+extern int file_wc_lines;   //MWG: -W
+extern size_t bcache_size;  //MWG: -k
+extern long bcache_hits, bcache_lookups; //MWG
+extern int g_statcache; //MWG: -m
+extern long statcache_hits, statcache_lookups; //MWG
+extern int g_host_getdents; //MWG: -g
 
 #endif
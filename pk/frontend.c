@@ -6,29 +6,125 @@
 #include "sbi.h"
 #include "mcall.h"
 #include "syscall.h"
+#include "vm.h"
+#include "file.h"
 #include <stdint.h>
+#include <string.h>
 
-uint64_t tohost_sync(unsigned dev, unsigned cmd, uint64_t payload)
+// A device request, plus whether its response has come in yet. Responses
+// can be received by a different tohost_sync() call on the same hart than
+// the one that sent the request, if one nests inside the other.
+typedef struct {
+  sbi_device_message m;
+  volatile int done;
+} device_request_t;
+
+static void tohost_send(device_request_t* r)
 {
-  uint64_t fromhost;
   __sync_synchronize();
+  r->done = 0;
+  kassert(do_mcall(MCALL_SEND_DEVICE_REQUEST, &r->m) == 0);
+}
+
+// Receive one response, if there is any, and mark its request done.
+static void tohost_poll()
+{
+  device_request_t* p = (void*)do_mcall(MCALL_RECEIVE_DEVICE_RESPONSE);
+  if (p)
+    p->done = 1;
+}
 
-  sbi_device_message m = {dev, cmd, payload}, *p;
-  do_mcall(MCALL_SEND_DEVICE_REQUEST, &m);
-  while ((p = (void*)do_mcall(MCALL_RECEIVE_DEVICE_RESPONSE)) == 0);
-  kassert(p == &m);
+// Supervisor mode waits with wfi: mentry.S hands the host interrupt to
+// htif_interrupt(), which raises SSIP, and only then do we trap into machine
+// mode to collect the response. Machine mode (e.g. a panic from a machine
+// trap) has nobody to raise SSIP for it, and SSIP may also be consumed by
+// handle_interrupt(), so we poll every so often regardless.
+#define TOHOST_POLL_INTERVAL 64
+int tohost_wfi = 0; // set once pk runs in supervisor mode
 
+static void tohost_wait(device_request_t* r)
+{
+  for (unsigned i = 1; !r->done; i++) {
+    if ((read_csr(sip) & SIP_SSIP) || i % TOHOST_POLL_INTERVAL == 0)
+      tohost_poll();
+    else if (tohost_wfi)
+      wfi();
+  }
   __sync_synchronize();
-  return m.data;
 }
 
-long frontend_syscall(long n, long a0, long a1, long a2, long a3, long a4, long a5, long a6)
+uint64_t tohost_sync(unsigned dev, unsigned cmd, uint64_t payload)
+{
+  device_request_t r = {{dev, cmd, payload}, 0};
+  tohost_send(&r);
+  tohost_wait(&r);
+  return r.m.data;
+}
+
+// Proxied syscalls are passed to the host in one of these slots, claimed
+// with a CAS so that harts don't serialize on a lock, and so that a syscall
+// made from a trap that interrupted another one (e.g. a memory DUE) doesn't
+// deadlock: it simply claims another slot.
+//
+// Slots double as a submission/completion ring for asynchronous writes
+// (-a): the write is submitted and the slot stays in flight, holding a copy
+// of the data, until its completion is reaped. The host answers requests in
+// order, so later syscalls on the same file see the write either way.
+#define FRONTEND_SLOTS 16
+#define SLOT_FREE 0
+#define SLOT_SYNC 1
+#define SLOT_ASYNC 2
+
+typedef struct {
+  volatile uint64_t magic_mem[8];
+  device_request_t req; // async only; sync requests live on the caller's stack
+  char* buf;            // async only, one page from frontend_init()
+} frontend_slot_t;
+
+static frontend_slot_t slots[FRONTEND_SLOTS] __attribute__((aligned(64)));
+static long slot_state[FRONTEND_SLOTS];
+static long next_slot;
+int g_async_writes = 0; //MWG: -a
+
+// Frees an async slot whose write has completed. Returns the write's result.
+static long reap_slot(size_t i)
+{
+  long ret = slots[i].magic_mem[0];
+  if (atomic_cas(&slot_state[i], SLOT_ASYNC, SLOT_FREE) != SLOT_ASYNC)
+    return 0; // someone else reaped it
+  if (ret < 0)
+    printk("pk: asynchronous write to host fd %ld failed: %ld\n", (long)slots[i].magic_mem[1], ret);
+  return ret;
+}
+
+static size_t claim_slot()
 {
-  static volatile uint64_t magic_mem[8];
+  size_t i = atomic_add(&next_slot, 1) % FRONTEND_SLOTS;
+  for (size_t tries = 1; ; tries++, i = (i + 1) % FRONTEND_SLOTS) {
+    long state = atomic_read(&slot_state[i]);
+    if (state == SLOT_ASYNC && slots[i].req.done)
+      reap_slot(i), state = atomic_read(&slot_state[i]);
+    if (state == SLOT_FREE && atomic_cas(&slot_state[i], SLOT_FREE, SLOT_SYNC) == SLOT_FREE)
+      break;
+    // every slot is taken; collect completions so in-flight writes can retire
+    if (tries % FRONTEND_SLOTS == 0)
+      tohost_poll();
+  }
+  mb();
+  return i;
+}
 
-  static spinlock_t lock = SPINLOCK_INIT;
-  spinlock_lock(&lock);
+static void release_slot(size_t i)
+{
+  mb();
+  atomic_set(&slot_state[i], SLOT_FREE);
+}
+
+long frontend_syscall(long n, long a0, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+  size_t i = claim_slot();
 
+  volatile uint64_t* magic_mem = slots[i].magic_mem;
   magic_mem[0] = n;
   magic_mem[1] = a0;
   magic_mem[2] = a1;
@@ -42,12 +138,77 @@ long frontend_syscall(long n, long a0, long a1, long a2, long a3, long a4, long
 
   long ret = magic_mem[0];
 
-  spinlock_unlock(&lock);
+  release_slot(i);
   return ret;
 }
 
+//MWG: Gives every slot its async buffer up front, so that the write path
+//never allocates: it can run from a panic raised while vm_lock is held.
+//Must run after pk_vm_init(), since the buffers come from the page pool.
+void frontend_init()
+{
+  if (!g_async_writes)
+    return;
+
+  size_t bufs = 0;
+  for (size_t i = 0; i < FRONTEND_SLOTS; i++)
+    if ((slots[i].buf = (char*)kernel_page_alloc(1)))
+      bufs++;
+  if (bufs == 0) {
+    printk("pk: no memory for asynchronous writes\n");
+    g_async_writes = 0;
+  }
+}
+
+// Submits a write of buf to host fd kfd without waiting for it. Returns 0
+// if it was queued, or -1 if the caller should write synchronously instead.
+long frontend_write_async(int kfd, const void* buf, size_t n)
+{
+  if (n > RISCV_PGSIZE)
+    return -1;
+
+  size_t i = claim_slot();
+  frontend_slot_t* s = &slots[i];
+  if (!s->buf) {
+    release_slot(i);
+    return -1;
+  }
+  memcpy(s->buf, buf, n);
+
+  s->magic_mem[0] = SYS_write;
+  s->magic_mem[1] = kfd;
+  s->magic_mem[2] = (uintptr_t)s->buf;
+  s->magic_mem[3] = n;
+  s->req.m.dev = 0;
+  s->req.m.cmd = 0;
+  s->req.m.data = (uintptr_t)s->magic_mem;
+  tohost_send(&s->req);
+
+  atomic_set(&slot_state[i], SLOT_ASYNC);
+  return 0;
+}
+
+// Waits for the asynchronous writes to host fd kfd (or to any fd, if kfd is
+// negative) to complete. Returns the first error among them, or 0.
+long frontend_drain(int kfd)
+{
+  long err = 0;
+  for (size_t i = 0; i < FRONTEND_SLOTS; i++) {
+    if (atomic_read(&slot_state[i]) != SLOT_ASYNC
+        || (kfd >= 0 && slots[i].magic_mem[1] != (uint64_t)kfd))
+      continue;
+    tohost_wait(&slots[i].req);
+    long ret = reap_slot(i);
+    if (ret < 0 && err == 0)
+      err = ret;
+  }
+  return err;
+}
+
 void die(int code)
 {
+  file_flush_all(); //MWG: -w
+  frontend_drain(-1);
   frontend_syscall(SYS_exit, code, 0, 0, 0, 0, 0, 0);
   while (1);
 }
@@ -4,6 +4,7 @@
 #define _RISCV_FRONTEND_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __riscv64
 # define TOHOST_CMD(dev, cmd, payload) \
@@ -20,5 +21,11 @@
 void die(int) __attribute__((noreturn));
 long frontend_syscall(long n, long a0, long a1, long a2, long a3, long a4, long a5, long a6);
 uint64_t tohost_sync(unsigned dev, unsigned cmd, uint64_t payload);
+void frontend_init();
+long frontend_write_async(int kfd, const void* buf, size_t n);
+long frontend_drain(int kfd);
+
+extern int g_async_writes;
+extern int tohost_wfi;
 
 #endif
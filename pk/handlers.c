@@ -10,13 +10,36 @@
 #include "config.h"
 #include "syscall.h"
 #include "vm.h"
+#include "atomic.h"
 
 user_due_trap_handler g_user_memory_due_trap_handler = NULL; //MWG
 due_candidates_t g_candidates; //MWG
 due_cacheline_t g_cacheline; //MWG
+word_t g_cheat_msg; //MWG
+int g_due_prefetched = 0; //MWG: DUE_PREFETCHED_BY(hart) when machine mode on that hart already drained the penalty box for the current DUE; only written under g_due_lock
+spinlock_t g_due_lock = SPINLOCK_INIT; //MWG: protects the g_* DUE buffers above
+int g_recover_whole_cacheline = 0; //MWG: -l
+static char* g_line_candidates_cstring = NULL; //MWG: page pool, for the other words in the line
+static due_candidates_t* g_line_candidates = NULL; //MWG: page pool, for the other words in the line
+
+//MWG: remembers the message chosen for a (word address, received word) pair, so hard faults that come back after writeback skip recovery
+typedef struct {
+  uintptr_t addr; // message-aligned address of the word, 0 if the entry is empty
+  word_t received;
+  word_t decision;
+} due_decision_t;
+
+#define DUE_DECISION_CACHE_ENTRIES (RISCV_PGSIZE / sizeof(due_decision_t))
+static due_decision_t* g_due_decisions = NULL; //MWG: page pool
+long g_due_decision_lookups = 0; //MWG
+long g_due_decision_hits = 0; //MWG
+long g_dues_reported = 0; //MWG: recoveries checked against the cheat message
+long g_dues_correct = 0; //MWG
 char g_candidates_cstring[G_CANDIDATES_CSTRING_SIZE]; //MWG
 char g_recovery_cstring[G_RECOVERY_CSTRING_SIZE]; //MWG
 
+static void __handle_memory_due(trapframe_t* tf); //MWG
+
 static void handle_illegal_instruction(trapframe_t* tf)
 {
   tf->insn = *(uint16_t*)tf->epc;
@@ -65,26 +88,39 @@ static void segfault(trapframe_t* tf, uintptr_t addr, const char* type)
 
 static void handle_fault_fetch(trapframe_t* tf)
 {
+  sw_due_tick(); //MWG
+  if (sw_due_fault(tf, PROT_EXEC) == 0) //MWG
+    return;
   if (handle_page_fault(tf->badvaddr, PROT_EXEC) != 0)
     segfault(tf, tf->badvaddr, "fetch");
 }
 
 void handle_fault_load(trapframe_t* tf)
 {
+  sw_due_tick(); //MWG
+  if (sw_due_fault(tf, PROT_READ) == 0) //MWG
+    return;
   if (handle_page_fault(tf->badvaddr, PROT_READ) != 0)
     segfault(tf, tf->badvaddr, "load");
 }
 
 void handle_fault_store(trapframe_t* tf)
 {
+  sw_due_tick(); //MWG
+  if (sw_due_fault(tf, PROT_WRITE) == 0) //MWG
+    return;
   if (handle_page_fault(tf->badvaddr, PROT_WRITE) != 0)
     segfault(tf, tf->badvaddr, "store");
 }
 
 static void handle_syscall(trapframe_t* tf)
 {
-  tf->gpr[10] = do_syscall(tf->gpr[10], tf->gpr[11], tf->gpr[12], tf->gpr[13],
-                           tf->gpr[14], tf->gpr[15], tf->gpr[17]);
+  sw_due_tick(); //MWG
+  if (tf->gpr[17] == SYS_checkpoint) //MWG: needs the whole trapframe
+    tf->gpr[10] = sys_checkpoint(tf, (const char*)tf->gpr[10]);
+  else
+    tf->gpr[10] = do_syscall(tf->gpr[10], tf->gpr[11], tf->gpr[12], tf->gpr[13],
+                             tf->gpr[14], tf->gpr[15], tf->gpr[17]);
   tf->epc += 4;
 }
 
@@ -133,19 +169,31 @@ int default_memory_due_trap_handler(trapframe_t* tf, int error_code, const char*
 
 //MWG
 void handle_memory_due(trapframe_t* tf) {
-  //TODO FIXME: 3/9/2017, Major corner-case issue: I finally found source of the rare hang bug. It occurs when a memory DUE occurs right when pk holds a lock in frontend_syscall(). In this case, the trap handler re-enters and will eventually find itself hung on its own lock!!!! That was the most horrible bug I have ever had to find.. took 4 solid days. Problem is, how do we fix it? Even die() and panic() use frontend_syscall() to talk to our host. We need to somehow escape the nested locking pattern, it's our only hope if we don't want that sort of hang.
-
   if ((tf->epc < 0x20000 && tf->epc >= 0) || (tf->badvaddr < 0x20000 && tf->badvaddr >= 0)) { //FIXME: hardcoded values
       default_memory_due_trap_handler(tf, -5, "DUE while fetching or loading from kernel address space"); 
       return;
   } 
-  
+
+  //If machine mode already read out the penalty box and could not finish the job, it hands us g_due_lock along with the prefetched state.
+  //Only our own hart can have set it to our id, and it then holds the lock until we clear it, so the unlocked read is safe.
+  if (g_due_prefetched != DUE_PREFETCHED_BY(SUPERVISOR_HART))
+      spinlock_lock(&g_due_lock);
+  __handle_memory_due(tf);
+  g_due_prefetched = 0;
+  spinlock_unlock(&g_due_lock);
+}
+
+//MWG
+static void __handle_memory_due(trapframe_t* tf) {
+  //TODO FIXME: 3/9/2017, Major corner-case issue: I finally found source of the rare hang bug. It occurs when a memory DUE occurs right when pk holds a lock in frontend_syscall(). In this case, the trap handler re-enters and will eventually find itself hung on its own lock!!!! That was the most horrible bug I have ever had to find.. took 4 solid days. Problem is, how do we fix it? Even die() and panic() use frontend_syscall() to talk to our host. We need to somehow escape the nested locking pattern, it's our only hope if we don't want that sort of hang.
+  //Update: frontend_syscall() now claims one of several slots with a CAS instead of taking a lock, so a nested syscall no longer hangs.
+
   if (g_user_memory_due_trap_handler == NULL) {
       default_memory_due_trap_handler(tf, -5, "no registered DUE handler"); 
       return;
   }
   
-  if (getDUECandidateMessages(&g_candidates) != 0 || getDUECacheline(&g_cacheline) != 0) {
+  if (!g_due_prefetched && getDUEState(tf->badvaddr, tf->epc) != 0) {
       default_memory_due_trap_handler(tf, -5, "kernel handler failed to get DUE candidates and/or cacheline SI"); 
       return;
   }
@@ -169,8 +217,8 @@ void handle_memory_due(trapframe_t* tf) {
    long demand_vaddr = 0;
    size_t demand_dest_reg = 0;
    int demand_float_regfile = 0;
-   int mem_type = (int)(read_csr(0x9)); //CSR_PENALTY_BOX_MEM_TYPE
-   size_t demand_load_size = read_csr(0x4); //CSR_PENALTY_BOX_LOAD_SIZE
+   int mem_type = (int)(read_penalty_box_csr(CSR_PENALTY_BOX_MEM_TYPE));
+   size_t demand_load_size = read_penalty_box_csr(CSR_PENALTY_BOX_LOAD_SIZE);
    if (mem_type == 0) { //data
        demand_vaddr = decode_load_vaddr(tf->insn, tf);
        demand_dest_reg = decode_rd(tf->insn);
@@ -183,6 +231,14 @@ void handle_memory_due(trapframe_t* tf) {
    
    int demand_load_message_offset = (int)(demand_vaddr - badvaddr); //Positive offset: DUE came before demand load
 
+   if (g_recover_whole_cacheline) {
+       int recovered_words = recover_rest_of_cacheline(printk, &g_cacheline, (badvaddr & ~(msg_size-1)) - g_cacheline.blockpos * msg_size);
+       if (recovered_words < 0)
+           default_memory_due_trap_handler(tf, recovered_words, "pk failed to recover the rest of the cacheline");
+       else if (recovered_words > 0)
+           printk("pk: DUE RECOVERY: %d other word(s) in the cacheline recovered\n", recovered_words);
+   }
+
    if (mem_type == 0 && (demand_dest_reg < 0 || demand_dest_reg > NUM_GPR || demand_dest_reg > NUM_FPR))
       default_memory_due_trap_handler(tf, -5, "pk decoded bad dest. reg from the insn");
 
@@ -195,7 +251,7 @@ void handle_memory_due(trapframe_t* tf) {
       default_memory_due_trap_handler(tf, error_code, "pk failed to set float trapframe");
    
    //For book-keeping only!!
-   if (getDUECheatMessage(&cheat_msg) != 0) {
+   if (copy_word(&cheat_msg, &g_cheat_msg) != 0) {
         default_memory_due_trap_handler(tf, -5, "pk failed to load cheat-recovery message for bookkeeping from HW");
         return;
    }
@@ -206,8 +262,15 @@ void handle_memory_due(trapframe_t* tf) {
        return;
    }
 
+   //For FP loads, a decisive ranking by FP plausibility stands in for the system policy
+   int fp_ranking_decisive = 0;
+   if (mem_type == 0 && demand_float_regfile && g_candidates.size > 1) {
+       fp_ranking_decisive = rank_fp_candidates(&g_candidates, &g_cacheline, demand_load_size, demand_load_message_offset);
+       serialize_sdecc_candidates(g_candidates_cstring, G_CANDIDATES_CSTRING_SIZE, &g_candidates);
+   }
+
    int system_suggested_to_crash = 0;
-   if (g_candidates.size > 1)
+   if (g_candidates.size > 1 && !fp_ranking_decisive)
        system_suggested_to_crash = do_system_recovery(&system_recovered_value); //"System" will figure out inst or data
    else
        copy_word(&system_recovered_value, g_candidates.candidate_messages);
@@ -232,6 +295,7 @@ void handle_memory_due(trapframe_t* tf) {
          error_code = writeback_recovered_message(&user_recovered_value, &recovered_load_value, tf, mem_type, demand_dest_reg, demand_float_regfile);
          if (error_code)
              default_memory_due_trap_handler(tf, error_code, "pk failed to write back recovered message during user-specified recovery");
+         remember_due_decision(tf->badvaddr, &g_cacheline, &user_recovered_value);
          if (mem_type == 0) //Only advance PC if the error was data mem, otherwise we want to re-fetch.
              tf->epc += 4;
          return;
@@ -252,6 +316,7 @@ void handle_memory_due(trapframe_t* tf) {
          error_code = writeback_recovered_message(&system_recovered_value, &recovered_load_value, tf, mem_type, demand_dest_reg, demand_float_regfile);
          if (error_code)
              default_memory_due_trap_handler(tf, error_code, "pk failed to write back recovered message during system-specified recovery");
+         remember_due_decision(tf->badvaddr, &g_cacheline, &system_recovered_value);
          if (mem_type == 0) //Only advance PC if the error was data mem, otherwise we want to re-fetch.
              tf->epc += 4;
          return;
@@ -277,12 +342,120 @@ void handle_memory_due(trapframe_t* tf) {
   default_memory_due_trap_handler(tf, -5, "this should not ever have happened"); 
 }
 
+//MWG: Called once the page pool is up. The DUE buffers that don't fit in pk's
+//image are allocated here, rather than on first use, so that the DUE path never
+//takes vm_lock while holding g_due_lock.
+void due_init() {
+    if (g_recover_whole_cacheline) {
+        size_t npage = (G_CANDIDATES_CSTRING_SIZE + sizeof(due_candidates_t) - 1) / RISCV_PGSIZE + 1;
+        uintptr_t buf = kernel_page_alloc(npage);
+        if (buf) {
+            g_line_candidates_cstring = (char*)buf;
+            g_line_candidates = (due_candidates_t*)(buf + G_CANDIDATES_CSTRING_SIZE);
+        }
+    }
+
+    g_due_decisions = (due_decision_t*)kernel_page_alloc(1);
+}
+
+//MWG: Drain the penalty box for the current DUE into g_cacheline, g_cheat_msg and g_candidates.
+//If we already recovered the same received word in the same cacheline, the earlier decision is
+//the only candidate and the hardware candidate generation is skipped. Otherwise the candidates
+//are filtered before any policy sees them: for instruction memory, those that decode to illegal
+//instructions are dropped; for 8-byte data in a line full of pointers, non-pointers go last.
+int getDUEState(uintptr_t badvaddr, uintptr_t epc) {
+    if (getDUECacheline(&g_cacheline) != 0 || getDUECheatMessage(&g_cheat_msg) != 0)
+        return -5;
+
+    if (lookup_due_decision(badvaddr, &g_cacheline, g_candidates.candidate_messages) == 0) {
+        g_candidates.size = 1;
+        return 0;
+    }
+
+    if (getDUECandidateMessages(&g_candidates) != 0)
+        return -5;
+
+    int mem_type = (int)read_penalty_box_csr(CSR_PENALTY_BOX_MEM_TYPE);
+    int filtered = 0;
+    if (mem_type == 1)
+        filtered = filter_illegal_insn_candidates(&g_candidates, &g_cacheline, (int)(epc - badvaddr)) > 0;
+    else if (mem_type == 0 && read_penalty_box_csr(CSR_PENALTY_BOX_LOAD_SIZE) == sizeof(uintptr_t))
+        filtered = demote_non_pointer_candidates(&g_candidates, &g_cacheline);
+    if (filtered)
+        serialize_sdecc_candidates(g_candidates_cstring, G_CANDIDATES_CSTRING_SIZE, &g_candidates);
+
+    return 0;
+}
+
+//MWG
+static due_decision_t* due_decision_slot(uintptr_t badvaddr, due_cacheline_t* cl, size_t word, uintptr_t* addr) {
+    if (!g_due_decisions || word >= cl->size)
+        return NULL;
+
+    word_t* received = cl->words + word;
+    *addr = badvaddr & ~(received->size-1);
+
+    size_t h = *addr / received->size;
+    for (size_t i = 0; i < received->size; i++)
+        h = h * 31 + received->bytes[i];
+    return g_due_decisions + h % DUE_DECISION_CACHE_ENTRIES;
+}
+
+//MWG: Returns 0 and fills in decision on a hit.
+int lookup_due_decision(uintptr_t badvaddr, due_cacheline_t* cl, word_t* decision) {
+    uintptr_t addr;
+    due_decision_t* d = due_decision_slot(badvaddr, cl, cl->blockpos, &addr);
+    if (!d)
+        return -1;
+
+    g_due_decision_lookups++;
+    word_t* received = cl->words + cl->blockpos;
+    if (d->addr != addr || d->received.size != received->size
+        || memcmp(d->received.bytes, received->bytes, received->size) != 0)
+        return -1;
+
+    g_due_decision_hits++;
+    return copy_word(decision, &d->decision);
+}
+
+//MWG: Remember the decision for word of cl, which sits at badvaddr.
+static void __remember_due_decision(uintptr_t badvaddr, due_cacheline_t* cl, size_t word, word_t* decision) {
+    uintptr_t addr;
+    due_decision_t* d = due_decision_slot(badvaddr, cl, word, &addr);
+    if (!d)
+        return;
+
+    d->addr = addr;
+    copy_word(&d->received, cl->words + word);
+    copy_word(&d->decision, decision);
+}
+
+//MWG
+void remember_due_decision(uintptr_t badvaddr, due_cacheline_t* cl, word_t* decision) {
+    __remember_due_decision(badvaddr, cl, cl->blockpos, decision);
+}
+
+//MWG: Forget the decisions for [addr, addr+len), which is being remapped.
+void invalidate_due_decisions(uintptr_t addr, size_t len) {
+    if (!g_due_decisions)
+        return;
+
+    spinlock_lock(&g_due_lock);
+    for (size_t i = 0; i < DUE_DECISION_CACHE_ENTRIES; i++)
+        if (g_due_decisions[i].addr >= addr && g_due_decisions[i].addr < addr + len)
+            g_due_decisions[i].addr = 0;
+    spinlock_unlock(&g_due_lock);
+}
+
 //MWG
 int getDUECandidateMessages(due_candidates_t* candidates) {
     //Magical Spike hook to compute candidates, so we don't have to re-implement in C
-    asm volatile("custom2 0,%0,0,0;"
-                 : 
-                 : "r" (&g_candidates_cstring));
+    if (g_sw_due)
+        sw_due_candidates(g_candidates_cstring, G_CANDIDATES_CSTRING_SIZE);
+    else
+        asm volatile("custom2 0,%0,0,0;"
+                     : 
+                     : "r" (&g_candidates_cstring));
 
     //Parse returned value
     parse_sdecc_candidate_output(g_candidates_cstring, G_CANDIDATES_CSTRING_SIZE, candidates);
@@ -290,19 +463,34 @@ int getDUECandidateMessages(due_candidates_t* candidates) {
     return 0; 
 }
 
+//MWG: Like getDUECandidateMessages(), but for any word of the fetched cacheline, not just the one that trapped.
+int getDUECandidateMessagesForWord(size_t word, char* cstring, size_t len, due_candidates_t* candidates) {
+    //Magical Spike hook, rs2 selects the word in the cacheline (plus one; zero means the word that trapped)
+    if (g_sw_due)
+        sw_due_candidates(cstring, len);
+    else
+        asm volatile("custom2 0,%0,%1,0;"
+                     : 
+                     : "r" (cstring), "r" (word+1));
+
+    parse_sdecc_candidate_output(cstring, len, candidates);
+    
+    return 0; 
+}
+
 //MWG
 int getDUECacheline(due_cacheline_t* cacheline) {
     if (!cacheline)
         return -5;
 
-    size_t wordsize = read_csr(0x5); //CSR_PENALTY_BOX_MSG_SIZE
-    size_t cacheline_size = read_csr(0x6); //CSR_PENALTY_BOX_CACHELINE_SIZE
-    size_t blockpos = read_csr(0x7); //CSR_PENALTY_BOX_CACHELINE_BLKPOS
+    size_t wordsize = read_penalty_box_csr(CSR_PENALTY_BOX_MSG_SIZE);
+    size_t cacheline_size = read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_SIZE);
+    size_t blockpos = read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_BLKPOS);
     size_t num_reads = (cacheline_size % sizeof(size_t) == 0 ? cacheline_size/sizeof(size_t) : cacheline_size/sizeof(size_t)+1);
     size_t cl[num_reads];
 
     for (size_t i = 0; i < num_reads; i++)
-        cl[i] = read_csr(0x8); //CSR_PENALTY_BOX_CACHELINE_WORD. Hardware will give us a different 64-bit chunk every iteration. If we over-read, then something bad may happen in HW.
+        cl[i] = read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_WORD); //Hardware will give us a different 64-bit chunk every iteration. If we over-read, then something bad may happen in HW.
 
     size_t words_per_block = cacheline_size / wordsize;
     char* cl_cast = (char*)(cl);
@@ -321,12 +509,12 @@ int getDUECheatMessage(word_t* cheat_msg) {
     if (!cheat_msg)
         return -5;
 
-    size_t wordsize = read_csr(0x5); //CSR_PENALTY_BOX_MSG_SIZE
+    size_t wordsize = read_penalty_box_csr(CSR_PENALTY_BOX_MSG_SIZE);
     size_t num_reads = (wordsize % sizeof(size_t) == 0 ? wordsize/sizeof(size_t) : wordsize/sizeof(size_t)+1);
     size_t victim_msg[num_reads];
 
     for (size_t i = 0; i < num_reads; i++)
-        victim_msg[i] = read_csr(0xb); //CSR_PENALTY_BOX_CHEAT_MSG. Hardware will give us a different 64-bit chunk every iteration. FIXME: If we over-read, then something bad may happen in HW.
+        victim_msg[i] = read_penalty_box_csr(CSR_PENALTY_BOX_CHEAT_MSG); //Hardware will give us a different 64-bit chunk every iteration. FIXME: If we over-read, then something bad may happen in HW.
 
     memcpy(cheat_msg->bytes, victim_msg, wordsize);
     cheat_msg->size = wordsize;
@@ -338,7 +526,7 @@ int getDUECheatMessage(word_t* cheat_msg) {
 void parse_sdecc_candidate_output(char* script_stdout, size_t len, due_candidates_t* candidates) {
       int count = 0;
       int k = 0;
-      size_t wordsize = read_csr(0x5); //CSR_PENALTY_BOX_MSG_SIZE
+      size_t wordsize = read_penalty_box_csr(CSR_PENALTY_BOX_MSG_SIZE);
       word_t w;
       w.size = wordsize;
       // Output is expected to be simply a bunch of rows, each with k=8*wordsize binary messages, e.g. '001010100101001...001010'
@@ -360,7 +548,7 @@ void parse_sdecc_candidate_output(char* script_stdout, size_t len, due_candidate
 //MWG
 int parse_sdecc_recovery_output(const char* script_stdout, word_t* w) {
       int k = 0;
-      size_t wordsize = read_csr(0x5); //CSR_PENALTY_BOX_MSG_SIZE, FIXME
+      size_t wordsize = read_penalty_box_csr(CSR_PENALTY_BOX_MSG_SIZE); //FIXME
       // Output is expected to be simply a bunch of rows, each with k=8*wordsize binary messages, e.g. '001010100101001...001010'
       for (size_t i = 0; i < wordsize; i++) {
           w->bytes[i] = 0;
@@ -379,14 +567,79 @@ int parse_sdecc_recovery_output(const char* script_stdout, word_t* w) {
 
 //MWG
 int do_system_recovery(word_t* w) {
+    return do_system_recovery_from(g_candidates_cstring, w);
+}
+
+//MWG
+int do_system_recovery_from(const char* candidates_cstring, word_t* w) {
     //Magical Spike hook to recover, so we don't have to re-implement in C
-    asm volatile("custom3 0,%0,%1,0;"
-                 : 
-                 : "r" (&g_recovery_cstring), "r" (&g_candidates_cstring));
+    if (g_sw_due)
+        sw_due_recover(g_recovery_cstring, G_RECOVERY_CSTRING_SIZE, candidates_cstring);
+    else
+        asm volatile("custom3 0,%0,%1,0;"
+                     : 
+                     : "r" (&g_recovery_cstring), "r" (candidates_cstring));
 
     return parse_sdecc_recovery_output(g_recovery_cstring, w);
 }
 
+//MWG: Recover every word of the fetched cacheline, besides the demand word, that
+//the penalty box flags as uncorrectable. Words are recovered in order with the
+//system policy, and each chosen message is patched into cl so that it serves as
+//side information for the words after it, including the demand word. Each is
+//also written back to memory at line_vaddr so later accesses stop trapping.
+//Words the policy would rather crash on are left alone; they will trap on their own.
+//Returns the number of words recovered, or -5.
+int recover_rest_of_cacheline(due_printer print, due_cacheline_t* cl, long line_vaddr) {
+    if (!cl || cl->size > MAX_CACHELINE_WORDS)
+        return -5;
+
+    size_t due_mask = read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_DUE_MASK); //bit i set if word i is uncorrectable
+    due_mask &= ~(1UL << cl->blockpos);
+    if (!due_mask)
+        return 0;
+
+    if (!g_line_candidates_cstring)
+        return -5;
+
+    //For book-keeping only!! Hardware gives us the uncorrupted line, one 64-bit chunk at a time.
+    size_t cacheline_size = read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_SIZE);
+    size_t num_reads = (cacheline_size % sizeof(size_t) == 0 ? cacheline_size/sizeof(size_t) : cacheline_size/sizeof(size_t)+1);
+    size_t cheat_line[num_reads];
+    for (size_t i = 0; i < num_reads; i++)
+        cheat_line[i] = read_penalty_box_csr(CSR_PENALTY_BOX_CHEAT_CACHELINE_WORD);
+
+    int recovered = 0;
+    for (size_t i = 0; i < cl->size; i++) {
+        if (!(due_mask & (1UL << i)))
+            continue;
+
+        if (getDUECandidateMessagesForWord(i, g_line_candidates_cstring, G_CANDIDATES_CSTRING_SIZE, g_line_candidates) != 0)
+            return -5;
+        if (g_line_candidates->size == 0)
+            continue;
+
+        word_t w;
+        copy_word(&w, g_line_candidates->candidate_messages);
+        if (g_line_candidates->size > 1 && do_system_recovery_from(g_line_candidates_cstring, &w) != 0)
+            continue;
+
+        word_t cheat;
+        cheat.size = w.size;
+        if ((i+1) * w.size > cacheline_size)
+            return -5;
+        memcpy(cheat.bytes, (char*)cheat_line + i*w.size, w.size);
+        print("pk: DUE RECOVERY: word %d of the cacheline\n", (int)i);
+        report_recovery(print, &w, &cheat, &w, &cheat, 0); //For bookkeeping only
+
+        __remember_due_decision(line_vaddr + i*w.size, cl, i, &w);
+        copy_word(cl->words+i, &w);
+        memcpy((void*)(line_vaddr + i*w.size), w.bytes, w.size);
+        recovered++;
+    }
+
+    return recovered;
+}
 
 //MWG
 int copy_word(word_t* dest, word_t* src) {
@@ -560,6 +813,10 @@ int writeback_recovered_message(word_t* recovered_message, word_t* load_value, t
                 return -5;
             }
         } else {
+            //MWG: follow the load's signedness, as the machine-mode fast path does: lb, lh, lw sign-extend; lbu, lhu, lwu don't
+            int shift = 8 * (sizeof(unsigned long) - load_value->size);
+            if (!(tf->insn & 0x4000) && shift > 0)
+                val = (unsigned long)((long)(val << shift) >> shift);
             tf->gpr[rd] = val; //Write load value to trapframe
         }
     }
@@ -928,13 +1185,23 @@ int set_float_trapframe(float_trapframe_t* float_tf) {
 
 //MWG
 void dump_word(word_t* w) {
-   printk("0x");
+   print_word(printk, w);
+}
+
+//MWG
+void print_word(due_printer print, word_t* w) {
+   print("0x");
    for (size_t i = 0; i < w->size; i++)
-       printk("%X", w->bytes[i]);
+       print("%X", w->bytes[i]);
 }
 
 //MWG
 int compare_recovery(word_t* recovered_value, word_t* cheat_msg, word_t* recovered_load_value, word_t* cheat_load_value, int demand_load_message_offset) {
+    return report_recovery(printk, recovered_value, cheat_msg, recovered_load_value, cheat_load_value, demand_load_message_offset);
+}
+
+//MWG: same as compare_recovery(), but usable from machine mode with print == printm
+int report_recovery(due_printer print, word_t* recovered_value, word_t* cheat_msg, word_t* recovered_load_value, word_t* cheat_load_value, int demand_load_message_offset) {
     if (!recovered_value || !cheat_msg || !recovered_load_value || !cheat_load_value)
         return -5;
 
@@ -967,39 +1234,41 @@ int compare_recovery(word_t* recovered_value, word_t* cheat_msg, word_t* recover
         }
     }
 
+    atomic_add(&g_dues_reported, 1);
     if (correct) {
         if (!mismatch) {
-            printk("pk: DUE RECOVERY: CORRECT\n");
+            print("pk: DUE RECOVERY: CORRECT\n");
+            atomic_add(&g_dues_correct, 1);
             retval = 0;
         } else {
-            printk("pk: DUE RECOVERY: MISMATCH BUG\n");
+            print("pk: DUE RECOVERY: MISMATCH BUG\n");
             retval = -5;
         }
     } else {
         if (overlap && mismatch) {
-            printk("pk: DUE RECOVERY: MCE\n");
+            print("pk: DUE RECOVERY: MCE\n");
             retval = 0;
         } else if (!overlap && mismatch) {
-            printk("pk: DUE RECOVERY: MISMATCH BUG\n");
+            print("pk: DUE RECOVERY: MISMATCH BUG\n");
             retval = -5;
         } else {
-            printk("pk: DUE RECOVERY: MCE\n"); //FIXME: partial overlap case, can be either MCE or MISMATCH BUG here.
+            print("pk: DUE RECOVERY: MCE\n"); //FIXME: partial overlap case, can be either MCE or MISMATCH BUG here.
             retval = 0;
         }
     }
 
-    printk("pk: Correct msg: ");
-    dump_word(cheat_msg);
-    printk("\n");
-    printk("pk: Chosen msg:  ");
-    dump_word(recovered_value);
-    printk("\n");
-    printk("pk: Correct load value: ");
-    dump_word(cheat_load_value);
-    printk("\n");
-    printk("pk: Chosen load value:  ");
-    dump_word(recovered_load_value);
-    printk("\n");
+    print("pk: Correct msg: ");
+    print_word(print, cheat_msg);
+    print("\n");
+    print("pk: Chosen msg:  ");
+    print_word(print, recovered_value);
+    print("\n");
+    print("pk: Correct load value: ");
+    print_word(print, cheat_load_value);
+    print("\n");
+    print("pk: Chosen load value:  ");
+    print_word(print, recovered_load_value);
+    print("\n");
 
     return retval;
 }
@@ -12,6 +12,8 @@
 elf_info current;
 int have_vm = 1; // unless -p flag is given
 
+static const char* restore_path; //MWG
+
 int uarch_counters_enabled;
 long uarch_counters[NUM_COUNTERS];
 char* uarch_counter_names[NUM_COUNTERS];
@@ -44,6 +46,74 @@ static void handle_option(const char* s)
       uarch_counters_enabled = 1;
       break;
 
+    case 'a': // don't wait for the host to finish writes; they complete in the background //MWG
+      g_async_writes = 1;
+      break;
+
+    case 'w': // combine writes smaller than <N> bytes (default a page) into one host write //MWG
+    case 'W': // same, and also flush stdout and stderr at every newline //MWG
+      file_wc_size = atol(s+2);
+      if (file_wc_size == 0)
+        file_wc_size = RISCV_PGSIZE;
+      file_wc_lines = s[1] == 'W';
+      break;
+
+    case 'k': // cache <N> KiB (default 256) of file data in pk, fetched with large host reads //MWG
+      bcache_size = atol(s+2) * 1024;
+      if (bcache_size == 0)
+        bcache_size = 256 * 1024;
+      break;
+
+    case 'f': // on a page fault, also populate the neighbouring pages in a block of <N> (default 16) //MWG
+      fault_around_pages = atol(s+2);
+      if (fault_around_pages == 0 || fault_around_pages > 512)
+        fault_around_pages = 16;
+      break;
+
+    case 'e': // read in and map the whole program up front, so -s and -c don't count demand paging //MWG
+      g_preload_elf = 1;
+      break;
+
+    case 'm': // cache the results of stat and access on paths, until pk changes any file //MWG
+      g_statcache = 1;
+      break;
+
+    case 'g': // the host proxies getdents64 (syscall 61); without it, the program gets ENOSYS //MWG
+      g_host_getdents = 1;
+      break;
+
+    case 'b': // scrub user memory on the other harts, one cacheline every <N> cycles //MWG
+      scrub_period = atol(s+2);
+      if (scrub_period <= 0)
+        scrub_period = 1000;
+      break;
+
+    case 'l': // on a DUE, also recover every other uncorrectable word in the cacheline //MWG
+      g_recover_whole_cacheline = 1;
+      break;
+
+    case 'd': // at exit, print a digest of dirtied user memory and of the program's output //MWG
+      g_memory_digest = 1;
+      break;
+
+    case 'n': // run the program <N> times in a row, resetting it in between //MWG
+      campaign_trials = atol(s+2);
+      if (campaign_trials <= 0)
+        panic("bad number of trials: `%s'", s+2);
+      break;
+
+    case 'r': // resume from the checkpoint in file <path> instead of loading an ELF //MWG
+      restore_path = s+2;
+      break;
+
+    case 'j': // inject a DUE in software at user address <addr>, on simulators without DUE support //MWG
+      sw_due_request(s+2);
+      break;
+
+    case 'J': // inject a DUE in software at a random resident word every <N> syscalls and page faults //MWG
+      sw_due_set_period(s+2);
+      break;
+
     default:
       panic("unrecognized option: `%c'", s[1]);
       break;
@@ -65,6 +135,9 @@ struct mainvars* parse_args(struct mainvars* args)
 
 void boot_loader(struct mainvars* args)
 {
+  if (restore_path) //MWG
+    run_restored_program(restore_path);
+
   // load program named by argv[0]
   long phdrs[128];
   current.phdr = (uintptr_t)phdrs;
@@ -5,6 +5,7 @@
 volatile uint32_t booted_harts_mask;
 uintptr_t mem_size;
 uint32_t num_harts;
+uint64_t timebase_freq; //MWG
 
 static void mstatus_init()
 {
@@ -58,6 +59,7 @@ static void fp_init()
 void hls_init(uint32_t id, uintptr_t* csrs)
 {
   hls_t* hls = OTHER_HLS(id);
+  kassert(sizeof(*hls) <= HLS_SIZE);
   memset(hls, 0, sizeof(*hls));
   hls->hart_id = id;
   hls->csrs = csrs;
@@ -8,8 +8,11 @@
 #include "frontend.h"
 #include "mcall.h"
 #include "vm.h"
+#include "atomic.h"
 #include <errno.h>
 
+extern spinlock_t g_due_lock; //MWG
+
 uintptr_t illegal_insn_trap(uintptr_t mcause, uintptr_t* regs)
 {
   asm (".pushsection .rodata\n"
@@ -87,6 +90,25 @@ void __attribute__((noreturn)) bad_trap()
   panic("machine mode: unhandlable trap %d @ %p", read_csr(mcause), read_csr(mepc));
 }
 
+// Returns the FIFO for (dev, cmd), or if there is none and create is set, a
+// free entry claimed for it. Returns NULL if neither is to be had.
+static device_request_queue_t* device_request_queue(uintptr_t dev, uintptr_t cmd, int create)
+{
+  uintptr_t key = DEVICE_REQUEST_KEY(dev, cmd);
+  device_request_queue_t* free = NULL;
+  for (size_t i = 0; i < DEVICE_REQUEST_QUEUES; i++) {
+    device_request_queue_t* q = &HLS()->device_request_queues[(key + i) % DEVICE_REQUEST_QUEUES];
+    if (q->head && q->key == key)
+      return q;
+    if (!q->head && !free)
+      free = q;
+  }
+  if (!create || !free)
+    return NULL;
+  free->key = key;
+  return free;
+}
+
 uintptr_t htif_interrupt(uintptr_t mcause, uintptr_t* regs)
 {
   uintptr_t fromhost = swap_csr(mfromhost, 0);
@@ -97,42 +119,151 @@ uintptr_t htif_interrupt(uintptr_t mcause, uintptr_t* regs)
   uintptr_t cmd = FROMHOST_CMD(fromhost);
   uintptr_t data = FROMHOST_DATA(fromhost);
 
-  sbi_device_message* m = HLS()->device_request_queue_head;
-  sbi_device_message* prev = NULL;
-  for (size_t i = 0, n = HLS()->device_request_queue_size; i < n; i++) {
-    if (!supervisor_paddr_valid(m, sizeof(*m))
-        && EXTRACT_FIELD(read_csr(mstatus), MSTATUS_PRV1) != PRV_M)
-      panic("htif: page fault");
-
-    sbi_device_message* next = (void*)m->sbi_private_data;
-    if (m->dev == dev && m->cmd == cmd) {
-      m->data = data;
-
-      // dequeue from request queue
-      if (prev)
-        prev->sbi_private_data = (uintptr_t)next;
-      else
-        HLS()->device_request_queue_head = next;
-      HLS()->device_request_queue_size = n-1;
-      m->sbi_private_data = 0;
-
-      // enqueue to response queue
-      if (HLS()->device_response_queue_tail)
-        HLS()->device_response_queue_tail->sbi_private_data = (uintptr_t)m;
-      else
-        HLS()->device_response_queue_head = m;
-      HLS()->device_response_queue_tail = m;
-
-      // signal software interrupt
-      set_csr(mip, MIP_SSIP);
-      return 0;
+  // The device answers in order, so the response belongs to the oldest
+  // request for (dev, cmd), which is the head of that pair's FIFO.
+  device_request_queue_t* q = device_request_queue(dev, cmd, 0);
+  if (!q)
+    panic("htif: no record");
+
+  sbi_device_message* m = q->head;
+  m->data = data;
+
+  // dequeue from request queue
+  q->head = (void*)m->sbi_private_data;
+  if (!q->head)
+    q->tail = NULL;
+  HLS()->device_request_queue_size--;
+  m->sbi_private_data = 0;
+
+  // enqueue to response queue
+  if (HLS()->device_response_queue_tail)
+    HLS()->device_response_queue_tail->sbi_private_data = (uintptr_t)m;
+  else
+    HLS()->device_response_queue_head = m;
+  HLS()->device_response_queue_tail = m;
+
+  // signal software interrupt
+  set_csr(mip, MIP_SSIP);
+  return 0;
+}
+
+//MWG: write the recovered message back to memory, bypassing the supervisor.
+static int due_store_message(word_t* msg, uintptr_t addr, int from_user)
+{
+  for (size_t i = 0; i < msg->size; i++) {
+    if (!from_user)
+      *(volatile uint8_t*)(addr + i) = msg->bytes[i];
+    else if (unpriv_store((uint8_t*)(addr + i), msg->bytes[i]))
+      return -1;
+  }
+  return 0;
+}
+
+//MWG: Complete a memory DUE without leaving machine mode when there is
+//nothing to decide, i.e. the decoder came up with exactly one candidate
+//message. Returns 0 if the DUE was recovered in place. Otherwise, the
+//penalty box state is left in g_candidates, g_cacheline and g_cheat_msg
+//(g_due_prefetched is set) for handle_memory_due() to pick up, since the
+//sequential-read CSRs cannot be read a second time.
+static uintptr_t memory_due_fast_path(uintptr_t* regs, uintptr_t mstatus, uintptr_t mepc, int from_user)
+{
+  uintptr_t badvaddr = read_csr(mbadaddr);
+  if (getDUEState(badvaddr, mepc) != 0)
+    return -1;
+  g_due_prefetched = DUE_PREFETCHED_BY(HLS()->hart_id);
+
+  if (g_candidates.size != 1)
+    return -1;
+
+  // Let the supervisor recover the rest of the line as well.
+  if (g_recover_whole_cacheline && (read_penalty_box_csr(CSR_PENALTY_BOX_CACHELINE_DUE_MASK) & ~(1UL << g_cacheline.blockpos)))
+    return -1;
+
+  int mem_type = (int)read_penalty_box_csr(CSR_PENALTY_BOX_MEM_TYPE);
+  size_t load_size = read_penalty_box_csr(CSR_PENALTY_BOX_LOAD_SIZE);
+  uintptr_t demand_vaddr;
+  insn_t insn = 0;
+
+  if (mem_type == 0) { //data
+    if (from_user) {
+      insn_fetch_t fetch = get_insn(CAUSE_MEMORY_DUE, mstatus, mepc);
+      if (fetch.error)
+        return -1;
+      insn = fetch.insn;
+    } else {
+      insn = *(uint16_t*)mepc;
+      if (insn_len(insn) == 4)
+        insn |= (uint32_t)*(uint16_t*)(mepc + 2) << 16;
+    }
+    if ((insn & 0x7f) != 0x03 && (insn & 0x7f) != 0x07) // LOAD or LOAD-FP
+      return -1;
+    demand_vaddr = GET_RS1(insn, regs) + IMM_I(insn);
+  } else if (mem_type == 1) { //inst
+    demand_vaddr = mepc;
+  } else {
+    return -1;
+  }
+
+  int offset = (int)(demand_vaddr - badvaddr);
+  word_t* msg = &g_candidates.candidate_messages[0];
+  word_t load_value, cheat_load_value;
+  if (load_value_from_message(msg, &load_value, &g_cacheline, load_size, offset) != 0
+      || load_value_from_message(&g_cheat_msg, &cheat_load_value, &g_cacheline, load_size, offset) != 0)
+    return -1;
+
+  //For bookkeeping only
+  if (report_recovery(printm, msg, &g_cheat_msg, &load_value, &cheat_load_value, offset) != 0)
+    panic("FAILED DUE RECOVERY, error code %d, reason: %s", -5, "pk failed to compare recovered value with cheat value for bookkeeping");
+
+  if (mem_type == 0) {
+    uintptr_t val = 0;
+    memcpy(&val, load_value.bytes, load_value.size);
+    if ((insn & MASK_FLW) == MATCH_FLW) {
+      SET_F32_RD(insn, regs, val);
+    } else if ((insn & MASK_FLD) == MATCH_FLD) {
+      SET_F64_RD(insn, regs, val);
+    } else {
+      int shift = 8 * (sizeof(uintptr_t) - load_value.size);
+      if (!(insn & 0x4000)) // lb, lh, lw sign-extend; lbu, lhu, lwu don't
+        val = (intptr_t)(val << shift) >> shift;
+      SET_RD(insn, regs, val);
     }
+  }
+
+  if (due_store_message(msg, badvaddr & -msg->size, from_user) != 0)
+    return -1;
+  remember_due_decision(badvaddr, &g_cacheline, msg);
+
+  if (mem_type == 0) //Only advance PC if the error was data mem, otherwise we want to re-fetch.
+    write_csr(mepc, mepc + insn_len(insn));
+  else
+    asm volatile ("fence.i");
+  return 0;
+}
+
+//MWG
+uintptr_t memory_due_trap(uintptr_t mcause, uintptr_t* regs)
+{
+  uintptr_t mstatus = read_csr(mstatus);
+  uintptr_t mepc = read_csr(mepc);
+  uintptr_t badvaddr = read_csr(mbadaddr);
 
-    prev = m;
-    m = (void*)atomic_read(&m->sbi_private_data);
+  // Kernel-space DUEs and processes without a handler are reported by
+  // handle_memory_due() in the supervisor.
+  if (g_user_memory_due_trap_handler == NULL || mepc < 0x20000 || badvaddr < 0x20000) //FIXME: hardcoded values, as in handle_memory_due()
+    return -1;
+
+  spinlock_lock(&g_due_lock);
+  if (memory_due_fast_path(regs, mstatus, mepc, 1) == 0) {
+    g_due_prefetched = 0;
+    spinlock_unlock(&g_due_lock);
+    return 0;
   }
 
-  panic("htif: no record");
+  // Redirect to the supervisor. If we prefetched, it inherits g_due_lock.
+  if (g_due_prefetched != DUE_PREFETCHED_BY(HLS()->hart_id))
+    spinlock_unlock(&g_due_lock);
+  return -1;
 }
 
 static uintptr_t mcall_hart_id()
@@ -180,11 +311,21 @@ static uintptr_t mcall_dev_req(sbi_device_message *m)
   if ((m->dev > 0xFFU) | (m->cmd > 0xFFU) | (m->data > 0x0000FFFFFFFFFFFFU))
     return -EINVAL;
 
+  // more distinct (dev, cmd) pairs in flight than there are FIFOs
+  device_request_queue_t* q = device_request_queue(m->dev, m->cmd, 1);
+  if (!q)
+    return -EBUSY;
+
   while (swap_csr(mtohost, TOHOST_CMD(m->dev, m->cmd, m->data)) != 0)
     ;
 
-  m->sbi_private_data = (uintptr_t)HLS()->device_request_queue_head;
-  HLS()->device_request_queue_head = m;
+  // append to the FIFO for (dev, cmd); m was validated above
+  m->sbi_private_data = 0;
+  if (q->tail)
+    q->tail->sbi_private_data = (uintptr_t)m;
+  else
+    q->head = m;
+  q->tail = m;
   HLS()->device_request_queue_size++;
 
   return 0;
@@ -321,6 +462,38 @@ static uintptr_t machine_illegal_instruction(uintptr_t mcause, uintptr_t* regs,
   bad_trap();
 }
 
+//MWG
+static uintptr_t machine_memory_due(uintptr_t mcause, uintptr_t* regs, uintptr_t mepc)
+{
+  // The scrubber only reads to surface latent errors; repair the line and move on.
+  if (HLS()->scrubbing) {
+    scrub_memory_due();
+    write_csr(mepc, mepc + insn_len(*(uint16_t*)mepc));
+    return 0;
+  }
+
+  // A DUE while emulating an access on behalf of a lower privilege level
+  // must not touch machine state, and we can't wait on g_due_lock if the
+  // supervisor holds it.
+  extern int32_t unprivileged_access_ranges[];
+  extern int32_t unprivileged_access_ranges_end[];
+  int unpriv = 0;
+  for (int32_t* p = unprivileged_access_ranges; p < unprivileged_access_ranges_end; p += 2)
+    unpriv |= mepc >= p[0] && mepc < p[1];
+
+  if (!unpriv && spinlock_trylock(&g_due_lock) == 0) {
+    int recovered = memory_due_fast_path(regs, read_csr(mstatus), mepc, 0) == 0;
+    g_due_prefetched = 0;
+    spinlock_unlock(&g_due_lock);
+    if (recovered)
+      return 0;
+  }
+
+  //MWG FIXME TODO: If the DUE can't be recovered in machine mode, we ignore its effects and pretend like it didn't happen.
+  write_csr(mepc, mepc + 4);
+  return 0;
+}
+
 uintptr_t trap_from_machine_mode(uintptr_t dummy, uintptr_t* regs)
 {
   uintptr_t mcause = read_csr(mcause);
@@ -338,9 +511,7 @@ uintptr_t trap_from_machine_mode(uintptr_t dummy, uintptr_t* regs)
     case CAUSE_MACHINE_ECALL:
       return mcall_trap(mcause, regs);
     case CAUSE_MEMORY_DUE: //MWG: non-standard
-      //MWG FIXME TODO: If the memory DUE trap is handled in machine mode (because program was in machine mode, we ignore its effects and pretend like it didn't happen.
-      write_csr(mepc, read_csr(mepc)+4);      
-      return 0;
+      return machine_memory_due(mcause, regs, mepc);
     default:
       bad_trap();
   }
@@ -219,8 +219,21 @@ static inline int xlen()
   return cpuid() < 0 ? 64 : 32;
 }
 
+// Outstanding device requests are kept in one FIFO per (dev, cmd) pair, so a
+// response is matched to the head of its pair's FIFO without walking any
+// list. The FIFOs live in a small open-addressed table keyed by the pair; an
+// empty FIFO frees its entry for another pair.
+#define DEVICE_REQUEST_QUEUES 8
+#define DEVICE_REQUEST_KEY(dev, cmd) ((dev) << 8 | (cmd))
+
+typedef struct {
+  sbi_device_message* head; // NULL if the entry is free
+  sbi_device_message* tail;
+  uintptr_t key;            // DEVICE_REQUEST_KEY of the pair it holds
+} device_request_queue_t;
+
 typedef struct {
-  sbi_device_message* device_request_queue_head;
+  device_request_queue_t device_request_queues[DEVICE_REQUEST_QUEUES];
   size_t device_request_queue_size;
   sbi_device_message* device_response_queue_head;
   sbi_device_message* device_response_queue_tail;
@@ -228,6 +241,7 @@ typedef struct {
   uintptr_t* csrs;
   int hart_id;
   int ipi_pending;
+  int scrubbing; //MWG: this hart runs scrub_loop()
 } hls_t;
 
 void hls_init(uint32_t hart_id, uintptr_t* csrs);
@@ -252,7 +266,7 @@ void hls_init(uint32_t hart_id, uintptr_t* csrs);
 #else
 # define SOFT_FLOAT_CONTEXT_SIZE (8 * 32)
 #endif
-#define HLS_SIZE 64
+#define HLS_SIZE 128
 #define INTEGER_CONTEXT_SIZE (32 * REGBYTES)
 
 #endif
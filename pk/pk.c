@@ -1,14 +1,17 @@
 #include "pk.h"
 #include "vm.h"
 #include "elf.h"
+#include "frontend.h"
+#include "file.h"
+#include "vdso.h"
 
-void run_loaded_program(struct mainvars* args)
+static uintptr_t enter_supervisor_mode()
 {
-  printk("pk: Starting user program shortly\n"); //MWG
-  if (current.is_supervisor)
-    panic("pk can't run kernel binaries; try using bbl instead");
-
   uintptr_t kernel_stack_top = pk_vm_init();
+  due_init(); //MWG
+  file_wc_init(); //MWG: -w
+  bcache_init(); //MWG: -k
+  frontend_init(); //MWG: -a
 
   extern char trap_entry;
   write_csr(stvec, &trap_entry);
@@ -16,7 +19,52 @@ void run_loaded_program(struct mainvars* args)
 
   // enter supervisor mode
   asm volatile("la t0, 1f; csrw mepc, t0; eret; 1:" ::: "t0");
+  tohost_wfi = 1;
+  return kernel_stack_top;
+}
+
+static void start_counters()
+{
+  if (current.t0) // start timer if so requested
+    current.t0 = rdcycle();
+
+  if (uarch_counters_enabled) { // start tracking the uarch counters if requested
+    size_t i = 0;
+    #define READ_CTR_INIT(name) do { \
+      while (i >= NUM_COUNTERS) ; \
+      long csr = read_csr(name); \
+      uarch_counters[i++] = csr; \
+    } while (0)
+    READ_CTR_INIT(cycle);   READ_CTR_INIT(instret);
+    READ_CTR_INIT(uarch0);  READ_CTR_INIT(uarch1);  READ_CTR_INIT(uarch2);
+    READ_CTR_INIT(uarch3);  READ_CTR_INIT(uarch4);  READ_CTR_INIT(uarch5);
+    READ_CTR_INIT(uarch6);  READ_CTR_INIT(uarch7);  READ_CTR_INIT(uarch8);
+    READ_CTR_INIT(uarch9);  READ_CTR_INIT(uarch10); READ_CTR_INIT(uarch11);
+    READ_CTR_INIT(uarch12); READ_CTR_INIT(uarch13); READ_CTR_INIT(uarch14);
+    READ_CTR_INIT(uarch15);
+    #undef READ_CTR_INIT
+  }
+}
+
+static uintptr_t kernel_stack_top;
+
+void run_loaded_program(struct mainvars* args)
+{
+  printk("pk: Starting user program shortly\n"); //MWG
+  if (current.is_supervisor)
+    panic("pk can't run kernel binaries; try using bbl instead");
 
+  kernel_stack_top = enter_supervisor_mode();
+  if (campaign_trials) //MWG
+    campaign_init(args);
+
+  rerun_loaded_program(args);
+}
+
+//MWG: sets up the user stack and enters the program; the address space must
+//be in the state load_elf() leaves it in. Used directly for campaign trials.
+void rerun_loaded_program(struct mainvars* args)
+{
   // copy phdrs to user stack
   size_t stack_top = current.stack_top - current.phdr_size;
   memcpy((void*)stack_top, (void*)current.phdr, current.phdr_size);
@@ -31,6 +79,8 @@ void run_loaded_program(struct mainvars* args)
   }
   stack_top &= -sizeof(void*);
 
+  uintptr_t vdso = vdso_map(); //MWG
+
   struct {
     long key;
     long value;
@@ -42,6 +92,7 @@ void run_loaded_program(struct mainvars* args)
     {AT_PAGESZ, RISCV_PGSIZE},
     {AT_SECURE, 0},
     {AT_RANDOM, stack_top},
+    {AT_PK_VDSO, vdso}, //MWG
     {AT_NULL, 0}
   };
 
@@ -72,25 +123,8 @@ void run_loaded_program(struct mainvars* args)
   else
     STACK_INIT(uint32_t);
 
-  if (current.t0) // start timer if so requested
-    current.t0 = rdcycle();
-
-  if (uarch_counters_enabled) { // start tracking the uarch counters if requested
-    size_t i = 0;
-    #define READ_CTR_INIT(name) do { \
-      while (i >= NUM_COUNTERS) ; \
-      long csr = read_csr(name); \
-      uarch_counters[i++] = csr; \
-    } while (0)
-    READ_CTR_INIT(cycle);   READ_CTR_INIT(instret);
-    READ_CTR_INIT(uarch0);  READ_CTR_INIT(uarch1);  READ_CTR_INIT(uarch2);
-    READ_CTR_INIT(uarch3);  READ_CTR_INIT(uarch4);  READ_CTR_INIT(uarch5);
-    READ_CTR_INIT(uarch6);  READ_CTR_INIT(uarch7);  READ_CTR_INIT(uarch8);
-    READ_CTR_INIT(uarch9);  READ_CTR_INIT(uarch10); READ_CTR_INIT(uarch11);
-    READ_CTR_INIT(uarch12); READ_CTR_INIT(uarch13); READ_CTR_INIT(uarch14);
-    READ_CTR_INIT(uarch15);
-    #undef READ_CTR_INIT
-  }
+  sw_due_init(); //MWG
+  start_counters();
 
   trapframe_t tf;
   init_tf(&tf, current.entry, stack_top, current.elf64);
@@ -99,8 +133,29 @@ void run_loaded_program(struct mainvars* args)
   start_user(&tf);
 }
 
+//MWG: like run_loaded_program(), but resumes a process saved by sys_checkpoint()
+void run_restored_program(const char* path)
+{
+  printk("pk: Restoring user program from %s\n", path);
+  file_t* f = checkpoint_open(path);
+  kernel_stack_top = enter_supervisor_mode();
+
+  trapframe_t tf;
+  checkpoint_restore(f, &tf);
+
+  sw_due_init();
+  start_counters();
+
+  __clear_cache(0, 0);
+  write_csr(sscratch, kernel_stack_top);
+  start_user(&tf);
+}
+
 void boot_other_hart()
 {
+  if (scrub_period) //MWG
+    scrub_loop();
+
   // stall all harts besides hart 0
   while (1)
     wfi();
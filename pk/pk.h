@@ -70,6 +70,8 @@ extern "C" {
 extern uintptr_t mem_size;
 extern int have_vm;
 extern uint32_t num_harts;
+extern uint64_t timebase_freq; //MWG: from the device tree, or 0
+uint64_t clock_freq(); //MWG
 extern volatile uint32_t booted_harts_mask;
 
 struct mainvars* parse_args(struct mainvars*);
@@ -90,6 +92,8 @@ void handle_fault_store(trapframe_t*);
 void handle_memory_due(trapframe_t*); //MWG: this is non-standard
 void boot_loader(struct mainvars*);
 void run_loaded_program(struct mainvars*);
+void run_restored_program(const char* path); //MWG
+void rerun_loaded_program(struct mainvars*) __attribute__((noreturn)); //MWG
 void boot_other_hart();
 
 //MWG
@@ -112,16 +116,34 @@ typedef struct {
 } due_cacheline_t;
       
 typedef void (*trap_handler)(trapframe_t*); //MWG
+typedef void (*due_printer)(const char*, ...); //MWG: printk or printm
 typedef int (*user_due_trap_handler)(trapframe_t*, float_trapframe_t*, long, due_candidates_t*, due_cacheline_t*, word_t*, size_t, size_t, int, int, int); //MWG
 int default_memory_due_trap_handler(trapframe_t*, int error_code, const char* expl); //MWG
 void sys_register_user_memory_due_trap_handler(user_due_trap_handler fptr); //MWG
 
+//MWG: with software DUE injection (-j/-J), the penalty box is emulated by due_inject.c
+#define __read_penalty_box_csr(csr) read_csr(csr)
+#define read_penalty_box_csr(csr) (g_sw_due ? sw_penalty_box_read(csr) : __read_penalty_box_csr(csr))
+
+void due_init(); //MWG
+int getDUEState(uintptr_t badvaddr, uintptr_t epc); //MWG
+int insn_is_legal(uint32_t insn); //MWG
+int filter_illegal_insn_candidates(due_candidates_t* candidates, due_cacheline_t* cl, int offset); //MWG
+int demote_non_pointer_candidates(due_candidates_t* candidates, due_cacheline_t* cl); //MWG
+int rank_fp_candidates(due_candidates_t* candidates, due_cacheline_t* cl, size_t load_size, int offset); //MWG
+void serialize_sdecc_candidates(char* cstring, size_t len, due_candidates_t* candidates); //MWG
+int lookup_due_decision(uintptr_t badvaddr, due_cacheline_t* cl, word_t* decision); //MWG
+void remember_due_decision(uintptr_t badvaddr, due_cacheline_t* cl, word_t* decision); //MWG
+void invalidate_due_decisions(uintptr_t addr, size_t len); //MWG
 int getDUECandidateMessages(due_candidates_t* candidates); //MWG
 void parse_sdecc_candidate_output(char* script_stdout, size_t len, due_candidates_t* candidates); //MWG
 int parse_sdecc_recovery_output(const char* script_stdout, word_t* w); //MWG
 int getDUECacheline(due_cacheline_t* cacheline); //MWG
 int getDUECheatMessage(word_t* cheat_msg); //MWG
 int do_system_recovery(word_t* w); //MWG
+int do_system_recovery_from(const char* candidates_cstring, word_t* w); //MWG
+int getDUECandidateMessagesForWord(size_t word, char* cstring, size_t len, due_candidates_t* candidates); //MWG
+int recover_rest_of_cacheline(due_printer print, due_cacheline_t* cl, long line_vaddr); //MWG
 int copy_word(word_t* dest, word_t* src); //MWG
 int copy_cacheline(due_cacheline_t* dest, due_cacheline_t* src); //MWG
 int copy_candidates(due_candidates_t* dest, due_candidates_t* src); //MWG
@@ -138,7 +160,62 @@ int get_float_register(size_t frd, unsigned long* raw_value); //MWG
 int set_float_register(size_t frd, unsigned long raw_value); //MWG
 int set_float_trapframe(float_trapframe_t* float_tf); //MWG
 void dump_word(word_t* w); //MWG
+void print_word(due_printer print, word_t* w); //MWG
 int compare_recovery(word_t* recovered_value, word_t* cheat_msg, word_t* recovered_load_value, word_t* cheat_load_value, int demand_load_message_offset); //MWG
+int report_recovery(due_printer print, word_t* recovered_value, word_t* cheat_msg, word_t* recovered_load_value, word_t* cheat_load_value, int demand_load_message_offset); //MWG
+
+//MWG: FNV-1a, for the output and memory digests
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+static inline uint64_t fnv1a(uint64_t h, const void* buf, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ ((const unsigned char*)buf)[i]) * FNV_PRIME;
+  return h;
+}
+
+extern int g_memory_digest; //MWG
+extern uint64_t g_output_digest; //MWG
+extern long campaign_trials; //MWG
+void campaign_init(struct mainvars* args); //MWG
+void campaign_exit(int code); //MWG
+struct file;
+long sys_checkpoint(trapframe_t* tf, const char* path); //MWG
+struct file* checkpoint_open(const char* path); //MWG
+void checkpoint_restore(struct file* f, trapframe_t* tf); //MWG
+void sw_due_request(const char* addr); //MWG
+void sw_due_set_period(const char* period); //MWG
+void sw_due_init(); //MWG
+void sw_due_tick(); //MWG
+int sw_due_fault(trapframe_t* tf, int prot); //MWG
+void sw_due_forget(uintptr_t addr, size_t len); //MWG
+uintptr_t sw_penalty_box_read(int csr); //MWG
+void sw_due_candidates(char* cstring, size_t len); //MWG
+void sw_due_recover(char* out, size_t len, const char* candidates_cstring); //MWG
+
+extern long scrub_period; //MWG
+extern long scrub_lines; //MWG
+extern long scrub_dues; //MWG
+extern long scrub_recovered; //MWG
+void scrub_loop() __attribute__((noreturn)); //MWG
+int scrub_memory_due(); //MWG
+
+extern user_due_trap_handler g_user_memory_due_trap_handler; //MWG
+extern due_candidates_t g_candidates; //MWG
+extern due_cacheline_t g_cacheline; //MWG
+extern word_t g_cheat_msg; //MWG
+extern int g_due_prefetched; //MWG
+//MWG: g_due_prefetched names the hart that drained the penalty box, so that a
+//DUE on another hart (e.g. a scrubber) is never mistaken for ours
+#define DUE_PREFETCHED_BY(hart) ((hart) + 1)
+#define SUPERVISOR_HART 0 // the only hart that runs the supervisor
+extern int g_recover_whole_cacheline; //MWG
+extern int g_sw_due; //MWG
+extern long g_sw_due_injected; //MWG
+extern long g_due_decision_lookups; //MWG
+extern long g_due_decision_hits; //MWG
+extern long g_dues_reported; //MWG
+extern long g_dues_correct; //MWG
 
 typedef struct {
   int elf64;
@@ -164,6 +241,7 @@ typedef struct {
 extern elf_info current;
 
 void load_elf(const char* fn, elf_info* info);
+extern int g_preload_elf; //MWG
 
 static inline int insn_len(long insn)
 {
@@ -0,0 +1,86 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+#include "pk.h"
+#include "mtrap.h"
+#include "atomic.h"
+#include "vm.h"
+
+#define SCRUB_LINE_SIZE 64
+
+extern spinlock_t g_due_lock;
+
+long scrub_period; // cycles between scrubbed lines; 0 leaves the other harts parked (-b)
+long scrub_lines;
+long scrub_dues;
+long scrub_recovered;
+
+//MWG: Called by machine_memory_due() when a scrub read on this hart takes a
+//DUE. There is no demand load to complete, so all we have to do is pick a
+//message (the system policy breaks ties) and write it back to memory before
+//the application gets to it.
+int scrub_memory_due()
+{
+  int ret = -1;
+  word_t msg;
+
+  atomic_add(&scrub_dues, 1);
+
+  // The supervisor on hart 0 never waits on us while holding the lock.
+  spinlock_lock(&g_due_lock);
+
+  uintptr_t badvaddr = read_csr(mbadaddr);
+  if (getDUEState(badvaddr, read_csr(mepc)) == 0 && g_candidates.size > 0) {
+    copy_word(&msg, &g_candidates.candidate_messages[0]);
+    if (g_candidates.size == 1 || do_system_recovery(&msg) == 0) {
+      printm("pk: scrubber on hart %d: DUE @ %p\n", HLS()->hart_id, badvaddr);
+      report_recovery(printm, &msg, &g_cheat_msg, &msg, &g_cheat_msg, 0); //For bookkeeping only
+      memcpy((void*)(badvaddr & -msg.size), msg.bytes, msg.size);
+      remember_due_decision(badvaddr, &g_cacheline, &msg);
+      if (g_recover_whole_cacheline)
+        recover_rest_of_cacheline(printm, &g_cacheline, (badvaddr & -msg.size) - g_cacheline.blockpos * msg.size);
+      atomic_add(&scrub_recovered, 1);
+      ret = 0;
+    }
+  }
+
+  spinlock_unlock(&g_due_lock);
+  return ret;
+}
+
+//MWG: Runs forever on each hart but hart 0, in machine mode. User memory is
+//identity-mapped, so we walk the resident user pages in the page table and
+//read one word of every cacheline through its physical address. Pages are
+//dealt out round-robin among the scrubbing harts.
+void scrub_loop()
+{
+  size_t nscrubbers = num_harts - 1, id = HLS()->hart_id - 1;
+
+  // wait until the user program has been loaded
+  while (atomic_read(&current.stack_top) == 0)
+    ;
+  mb();
+
+  HLS()->scrubbing = 1;
+  uintptr_t next = rdcycle();
+
+  while (1) {
+    for (uintptr_t a = current.first_user_vaddr;
+         (a = next_resident_page(a, current.stack_top)) != 0; a += RISCV_PGSIZE) {
+      if ((a >> RISCV_PGSHIFT) % nscrubbers != id)
+        continue;
+
+      for (uintptr_t line = a; line < a + RISCV_PGSIZE; line += SCRUB_LINE_SIZE) {
+        while (rdcycle() < next)
+          ;
+        atomic_read((long*)line);
+        atomic_add(&scrub_lines, 1);
+        next = rdcycle() + scrub_period;
+      }
+    }
+  }
+}
@@ -0,0 +1,117 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// Path metadata cache (-m). Programs tend to stat and access() the same
+// paths over and over at startup, and each of those is a host round trip.
+// Results, failures included, are kept in a small set-associative table
+// keyed by path and by which lookup it was, and evicted LRU within a set.
+//
+// Only absolute paths and paths relative to the working directory are
+// cached, since pk has no chdir and an fd-relative lookup depends on what the
+// fd names. Anything pk does that could change metadata (creating, linking,
+// unlinking, truncating or writing a file) drops the whole cache; changes
+// made on the host behind pk's back are not noticed.
+
+#include "pk.h"
+#include "file.h"
+#include "atomic.h"
+#include <string.h>
+
+#define STATCACHE_SETS 16
+#define STATCACHE_WAYS 4
+#define STATCACHE_PATH 120
+
+typedef struct {
+  uint64_t hash;  // 0 if the entry is empty
+  long kind;
+  long ret;
+  unsigned long used;
+  struct stat st;
+  char path[STATCACHE_PATH];
+} statcache_entry_t;
+
+int g_statcache = 0; //MWG: -m
+long statcache_hits, statcache_lookups;
+static statcache_entry_t entries[STATCACHE_SETS][STATCACHE_WAYS];
+static unsigned long statcache_clock;
+static spinlock_t statcache_lock = SPINLOCK_INIT;
+
+static uint64_t statcache_hash(long kind, const char* path)
+{
+  uint64_t h = fnv1a(fnv1a(FNV_OFFSET_BASIS, &kind, sizeof(kind)), path, strlen(path));
+  return h ? h : 1;
+}
+
+static statcache_entry_t* __statcache_find(uint64_t h, long kind, const char* path)
+{
+  statcache_entry_t* set = entries[h % STATCACHE_SETS];
+  for (statcache_entry_t* e = set; e < set + STATCACHE_WAYS; e++)
+    if (e->hash == h && e->kind == kind && strcmp(e->path, path) == 0)
+      return e;
+  return NULL;
+}
+
+//MWG: Looks up the result of lookup kind on path. On a hit, returns 0 and
+//sets *ret, and copies the stat buffer to st if the lookup had one.
+int statcache_get(long kind, const char* path, void* st, long* ret)
+{
+  if (!g_statcache || strlen(path) >= STATCACHE_PATH)
+    return -1;
+
+  uint64_t h = statcache_hash(kind, path);
+  int hit = -1;
+  spinlock_lock(&statcache_lock);
+    statcache_lookups++;
+    statcache_entry_t* e = __statcache_find(h, kind, path);
+    if (e) {
+      statcache_hits++;
+      e->used = ++statcache_clock;
+      *ret = e->ret;
+      if (st && e->ret == 0)
+        memcpy(st, &e->st, sizeof(e->st));
+      hit = 0;
+    }
+  spinlock_unlock(&statcache_lock);
+  return hit;
+}
+
+//MWG: Records the host's answer to lookup kind on path.
+void statcache_put(long kind, const char* path, const void* st, long ret)
+{
+  if (!g_statcache || strlen(path) >= STATCACHE_PATH)
+    return;
+
+  uint64_t h = statcache_hash(kind, path);
+  spinlock_lock(&statcache_lock);
+    statcache_entry_t* e = __statcache_find(h, kind, path);
+    if (!e) {
+      statcache_entry_t* set = entries[h % STATCACHE_SETS];
+      e = set;
+      for (statcache_entry_t* v = set; v < set + STATCACHE_WAYS && e->hash; v++)
+        if (!v->hash || v->used < e->used)
+          e = v;
+    }
+    e->hash = h;
+    e->kind = kind;
+    e->ret = ret;
+    e->used = ++statcache_clock;
+    if (st && ret == 0)
+      memcpy(&e->st, st, sizeof(e->st));
+    strcpy(e->path, path);
+  spinlock_unlock(&statcache_lock);
+}
+
+void statcache_invalidate()
+{
+  if (!g_statcache)
+    return;
+  spinlock_lock(&statcache_lock);
+    for (size_t i = 0; i < STATCACHE_SETS; i++)
+      for (size_t j = 0; j < STATCACHE_WAYS; j++)
+        entries[i][j].hash = 0;
+  spinlock_unlock(&statcache_lock);
+}
@@ -14,6 +14,9 @@
 #include <string.h>
 #include <errno.h>
 
+int g_memory_digest = 0; //MWG: -d
+uint64_t g_output_digest = FNV_OFFSET_BASIS; //MWG: everything the program wrote, when -d or -n is given
+
 typedef long (*syscall_t)(long, long, long, long, long, long, long);
 
 #define long_bytes (4 + 4*current.elf64)
@@ -26,6 +29,7 @@ typedef long (*syscall_t)(long, long, long, long, long, long, long);
   else ((int*)base)[i] = (data); })
 
 #define CLOCK_FREQ 1000000000
+#define CLOCK_BOOTTIME 7 //MWG: the last of the clock ids pk serves
 
 void sys_exit(int code)
 {
@@ -56,6 +60,30 @@ void sys_exit(int code)
     }
   }
 
+  if (g_due_decision_lookups) //MWG
+    printk("pk: DUE decision cache: %ld hits / %ld lookups\n", g_due_decision_hits, g_due_decision_lookups);
+
+  if (g_sw_due) //MWG
+    printk("pk: %ld DUEs injected in software\n", g_sw_due_injected);
+
+  if (bcache_size) //MWG
+    printk("pk: block cache: %ld hits / %ld lookups\n", bcache_hits, bcache_lookups);
+
+  if (g_statcache) //MWG
+    printk("pk: metadata cache: %ld hits / %ld lookups\n", statcache_hits, statcache_lookups);
+
+  if (scrub_period) //MWG
+    printk("pk: scrubber: %ld lines, %ld DUEs, %ld recovered\n", scrub_lines, scrub_dues, scrub_recovered);
+
+  if (g_memory_digest) { //MWG
+    size_t dirty_pages;
+    uint64_t mem_digest = vm_dirty_digest(&dirty_pages);
+    printk("pk: memory digest %lx over %ld dirty pages, output digest %lx\n", mem_digest, dirty_pages, g_output_digest);
+  }
+
+  if (campaign_trials) //MWG: only returns after the last trial
+    campaign_exit(code);
+
   die(code);
 }
 
@@ -87,6 +115,12 @@ ssize_t sys_pread(int fd, char* buf, size_t n, off_t offset)
   return r;
 }
 
+//MWG: -d and -n fingerprint everything the program writes
+static void digest_output(int fd, const void* buf, size_t n)
+{
+  g_output_digest = fnv1a(fnv1a(g_output_digest, &fd, sizeof(fd)), buf, n);
+}
+
 ssize_t sys_write(int fd, const char* buf, size_t n)
 {
   ssize_t r = -EBADF;
@@ -98,6 +132,9 @@ ssize_t sys_write(int fd, const char* buf, size_t n)
     file_decref(f);
   }
 
+  if ((campaign_trials || g_memory_digest) && r > 0) //MWG
+    digest_output(fd, buf, r);
+
   return r;
 }
 
@@ -137,10 +174,7 @@ int sys_open(const char* name, int flags, int mode)
 
 int sys_close(int fd)
 {
-  int ret = fd_close(fd);
-  if (ret < 0)
-    return -EBADF;
-  return ret;
+  return fd_close(fd);
 }
 
 int sys_fstat(int fd, void* st)
@@ -185,6 +219,24 @@ int sys_ftruncate(int fd, off_t len)
   return r;
 }
 
+//MWG: The host doesn't proxy fsync, so this only hands what -w buffered to
+//the host and waits for the -a writes to the file to land.
+int sys_fsync(int fd)
+{
+  int r = -EBADF;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = file_flush(f);
+    if (r == 0)
+      r = frontend_drain(f->kfd);
+    file_decref(f);
+  }
+
+  return r;
+}
+
 int sys_dup(int fd)
 {
   int r = -EBADF;
@@ -217,7 +269,12 @@ long sys_lstat(const char* name, void* st)
 {
   size_t name_size = strlen(name)+1;
   populate_mapping(st, sizeof(struct stat), PROT_WRITE);
-  return frontend_syscall(SYS_lstat, (uintptr_t)name, name_size, (uintptr_t)st, 0, 0, 0, 0);
+  long ret;
+  if (statcache_get(STATCACHE_LSTAT, name, st, &ret) == 0) //MWG: -m
+    return ret;
+  ret = frontend_syscall(SYS_lstat, (uintptr_t)name, name_size, (uintptr_t)st, 0, 0, 0, 0);
+  statcache_put(STATCACHE_LSTAT, name, st, ret);
+  return ret;
 }
 
 long sys_fstatat(int dirfd, const char* name, void* st, int flags)
@@ -226,7 +283,14 @@ long sys_fstatat(int dirfd, const char* name, void* st, int flags)
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
     populate_mapping(st, sizeof(struct stat), PROT_WRITE);
-    return frontend_syscall(SYS_fstatat, kfd, (uintptr_t)name, name_size, (uintptr_t)st, flags, 0, 0);
+    long ret;
+    int cacheable = dirfd == AT_FDCWD || name[0] == '/'; //MWG: -m
+    if (cacheable && statcache_get(STATCACHE_FSTATAT(flags), name, st, &ret) == 0)
+      return ret;
+    ret = frontend_syscall(SYS_fstatat, kfd, (uintptr_t)name, name_size, (uintptr_t)st, flags, 0, 0);
+    if (cacheable)
+      statcache_put(STATCACHE_FSTATAT(flags), name, st, ret);
+    return ret;
   }
   return -EBADF;
 }
@@ -241,7 +305,14 @@ long sys_faccessat(int dirfd, const char *name, int mode)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
-    return frontend_syscall(SYS_faccessat, kfd, (uintptr_t)name, name_size, mode, 0, 0, 0);
+    long ret;
+    int cacheable = dirfd == AT_FDCWD || name[0] == '/'; //MWG: -m
+    if (cacheable && statcache_get(STATCACHE_ACCESS(mode), name, NULL, &ret) == 0)
+      return ret;
+    ret = frontend_syscall(SYS_faccessat, kfd, (uintptr_t)name, name_size, mode, 0, 0, 0);
+    if (cacheable)
+      statcache_put(STATCACHE_ACCESS(mode), name, NULL, ret);
+    return ret;
   }
   return -EBADF;
 }
@@ -258,6 +329,7 @@ long sys_linkat(int old_dirfd, const char* old_name, int new_dirfd, const char*
   if (old_kfd != -1 && new_kfd != -1) {
     size_t old_size = strlen(old_name)+1;
     size_t new_size = strlen(new_name)+1;
+    statcache_invalidate(); //MWG: -m
     return frontend_syscall(SYS_linkat, old_kfd, (uintptr_t)old_name, old_size,
                                         new_kfd, (uintptr_t)new_name, new_size,
                                         flags);
@@ -275,6 +347,7 @@ long sys_unlinkat(int dirfd, const char* name, int flags)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
+    statcache_invalidate(); //MWG: -m
     return frontend_syscall(SYS_unlinkat, kfd, (uintptr_t)name, name_size, flags, 0, 0, 0);
   }
   return -EBADF;
@@ -290,6 +363,7 @@ long sys_mkdirat(int dirfd, const char* name, int mode)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     size_t name_size = strlen(name)+1;
+    statcache_invalidate(); //MWG: -m
     return frontend_syscall(SYS_mkdirat, kfd, (uintptr_t)name, name_size, mode, 0, 0, 0);
   }
   return -EBADF;
@@ -366,9 +440,39 @@ int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
   return 0;
 }
 
+//MWG: pk's clock is the time CSR at the device tree's timebase-frequency or,
+//if the device tree doesn't give one, the cycle counter at CLOCK_FREQ. The
+//vDSO (vdso.S) reads the same clock.
+uint64_t clock_freq()
+{
+  return timebase_freq ? timebase_freq : CLOCK_FREQ;
+}
+
+static uint64_t clock_ticks()
+{
+  return timebase_freq ? rdtime() : rdcycle();
+}
+
+// time since boot, in whole seconds and nanoseconds past that. The fraction
+// is worked out one decimal digit at a time, so no intermediate product
+// overflows however fast the clock is.
+static void clock_now(uint64_t* sec, uint64_t* nsec)
+{
+  uint64_t t = clock_ticks(), freq = clock_freq();
+  uint64_t rem = t % freq;
+  *sec = t / freq;
+  *nsec = 0;
+  for (int i = 0; i < 9; i++) {
+    rem *= 10;
+    *nsec = *nsec * 10 + rem / freq;
+    rem %= freq;
+  }
+}
+
 long sys_time(void* loc)
 {
-  uintptr_t t = rdcycle() / CLOCK_FREQ;
+  uint64_t t, nsec;
+  clock_now(&t, &nsec);
   if (loc)
   {
     populate_mapping(loc, long_bytes, PROT_WRITE);
@@ -381,9 +485,9 @@ int sys_times(void* restrict loc)
 {
   populate_mapping(loc, 4*long_bytes, PROT_WRITE);
 
-  uintptr_t t = rdcycle();
-  kassert(CLOCK_FREQ % 1000000 == 0);
-  put_long(loc, 0, t / (CLOCK_FREQ / 1000000));
+  uint64_t sec, nsec;
+  clock_now(&sec, &nsec);
+  put_long(loc, 0, sec * 1000000 + nsec / 1000);
   put_long(loc, 1, 0);
   put_long(loc, 2, 0);
   put_long(loc, 3, 0);
@@ -395,31 +499,171 @@ int sys_gettimeofday(long* loc)
 {
   populate_mapping(loc, 2*long_bytes, PROT_WRITE);
 
-  uintptr_t t = rdcycle();
-  put_long(loc, 0, t/CLOCK_FREQ);
-  put_long(loc, 1, (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000));
+  uint64_t sec, nsec;
+  clock_now(&sec, &nsec);
+  put_long(loc, 0, sec);
+  put_long(loc, 1, nsec / 1000);
   
   return 0;
 }
 
-ssize_t sys_writev(int fd, const void* iov, int cnt)
+//MWG: every clock, from CLOCK_REALTIME to CLOCK_BOOTTIME, is time since
+//boot; the alarm clocks and dynamic (fd-based) ids are rejected. RV32
+//timespecs have 32-bit fields.
+int sys_clock_gettime(int clk, long* loc)
 {
+  if (clk < 0 || clk > CLOCK_BOOTTIME)
+    return -EINVAL;
+
+  populate_mapping(loc, 2*long_bytes, PROT_WRITE);
+
+  uint64_t sec, nsec;
+  clock_now(&sec, &nsec);
+  put_long(loc, 0, sec);
+  put_long(loc, 1, nsec);
+
+  return 0;
+}
+
+//MWG: readv/writev and friends. The host has no vectored command, so runs
+//of small iovecs are gathered into (or scattered from) one bounce page and
+//cost a single host request per page rather than one per iovec. An iovec
+//that doesn't fit in the page goes to the host directly.
+#define IOV_MAX 1024
+#ifndef SSIZE_MAX
+#define SSIZE_MAX ((size_t)-1 >> 1)
+#endif
+#define iov_base(iov, i) ((char*)get_long(iov, 2*(i)))
+#define iov_len(iov, i) ((size_t)get_long(iov, 2*(i)+1))
+static char* iov_bounce;
+
+// off < 0 means the file position
+static ssize_t iov_transfer(file_t* f, void* buf, size_t n, off_t* off, int write)
+{
+  ssize_t r;
+  if (write)
+    r = *off < 0 ? file_write(f, buf, n) : file_pwrite(f, buf, n, *off);
+  else
+    r = *off < 0 ? file_read(f, buf, n) : file_pread(f, buf, n, *off);
+  if (r > 0 && *off >= 0)
+    *off += r;
+  return r;
+}
+
+static ssize_t sys_rwv(int fd, const void* iov, int cnt, off_t off, int write)
+{
+  if (cnt < 0 || cnt > IOV_MAX)
+    return -EINVAL;
+  file_t* f = file_get(fd);
+  if (!f)
+    return -EBADF;
+
   populate_mapping(iov, cnt*2*long_bytes, PROT_READ);
 
+  // like Linux, refuse a total that doesn't fit in the return value
+  size_t total = 0;
+  for (size_t i = 0; i < (size_t)cnt; i++)
+  {
+    if (iov_len(iov, i) > SSIZE_MAX - total)
+    {
+      file_decref(f);
+      return -EINVAL;
+    }
+    total += iov_len(iov, i);
+  }
+
+  if (!iov_bounce)
+    iov_bounce = (char*)kernel_page_alloc(1);
+
   ssize_t ret = 0;
-  for (int i = 0; i < cnt; i++)
+  for (size_t i = 0, j; i < (size_t)cnt; i = j)
   {
-    ssize_t r = sys_write(fd, (void*)get_long(iov, 2*i), get_long(iov, 2*i+1));
+    // iovecs [i, j) go in this request
+    size_t n = 0;
+    for (j = i; iov_bounce && j < (size_t)cnt && iov_len(iov, j) <= RISCV_PGSIZE - n; j++)
+      n += iov_len(iov, j);
+
+    ssize_t r;
+    if (j == i)
+    {
+      n = iov_len(iov, i);
+      r = iov_transfer(f, iov_base(iov, i), n, &off, write);
+      j = i + 1;
+    }
+    else
+    {
+      if (write)
+        for (size_t k = i, pos = 0; k < j; pos += iov_len(iov, k), k++)
+        {
+          populate_mapping(iov_base(iov, k), iov_len(iov, k), PROT_READ);
+          memcpy(iov_bounce + pos, iov_base(iov, k), iov_len(iov, k));
+        }
+      r = iov_transfer(f, iov_bounce, n, &off, write);
+      if (!write)
+        for (size_t k = i, pos = 0; k < j && (ssize_t)pos < r; pos += iov_len(iov, k), k++)
+        {
+          size_t len = MIN(iov_len(iov, k), r - pos);
+          populate_mapping(iov_base(iov, k), len, PROT_WRITE);
+          memcpy(iov_base(iov, k), iov_bounce + pos, len);
+        }
+    }
+
     if (r < 0)
-      return r;
+    {
+      if (ret == 0)
+        ret = r;
+      break;
+    }
+    if (write && (campaign_trials || g_memory_digest))
+      for (size_t k = i, pos = 0; k < j && (ssize_t)pos < r; pos += iov_len(iov, k), k++)
+        digest_output(fd, iov_base(iov, k), MIN(iov_len(iov, k), r - pos));
     ret += r;
+    if ((size_t)r < n)
+      break;
   }
+
+  file_decref(f);
   return ret;
 }
 
-int sys_getdents(int fd, void* dirbuf, int count)
+// the offset comes in two halves on RV32
+#define iov_off(lo, hi) (current.elf64 ? (off_t)(lo) : (off_t)((uint32_t)(lo) | ((uint64_t)(hi) << 32)))
+
+ssize_t sys_writev(int fd, const void* iov, int cnt)
 {
-  return 0; //stub
+  return sys_rwv(fd, iov, cnt, -1, 1);
+}
+
+ssize_t sys_readv(int fd, const void* iov, int cnt)
+{
+  return sys_rwv(fd, iov, cnt, -1, 0);
+}
+
+ssize_t sys_pwritev(int fd, const void* iov, int cnt, long lo, long hi)
+{
+  off_t off = iov_off(lo, hi);
+  return off < 0 ? -EINVAL : sys_rwv(fd, iov, cnt, off, 1);
+}
+
+ssize_t sys_preadv(int fd, const void* iov, int cnt, long lo, long hi)
+{
+  off_t off = iov_off(lo, hi);
+  return off < 0 ? -EINVAL : sys_rwv(fd, iov, cnt, off, 0);
+}
+
+//MWG: getdents64
+long sys_getdents(int fd, void* dirbuf, int count)
+{
+  ssize_t r = -EBADF;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = count < 0 ? -EINVAL : file_getdents(f, dirbuf, count);
+    file_decref(f);
+  }
+
+  return r;
 }
 
 static int sys_stub_success()
@@ -464,15 +708,19 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_gettimeofday] = sys_gettimeofday,
     [SYS_times] = sys_times,
     [SYS_writev] = sys_writev,
+    [SYS_readv] = sys_readv, //MWG
+    [SYS_preadv] = sys_preadv, //MWG
+    [SYS_pwritev] = sys_pwritev, //MWG
     [SYS_faccessat] = sys_faccessat,
     [SYS_fcntl] = sys_fcntl,
     [SYS_ftruncate] = sys_ftruncate,
+    [SYS_fsync] = sys_fsync, //MWG
     [SYS_getdents] = sys_getdents,
     [SYS_dup] = sys_dup,
     [SYS_readlinkat] = sys_stub_nosys,
     [SYS_rt_sigprocmask] = sys_stub_success,
     [SYS_ioctl] = sys_stub_nosys,
-    [SYS_clock_gettime] = sys_stub_nosys,
+    [SYS_clock_gettime] = sys_clock_gettime, //MWG
     [SYS_getrusage] = sys_stub_nosys,
     [SYS_getrlimit] = sys_stub_nosys,
     [SYS_setrlimit] = sys_stub_nosys,
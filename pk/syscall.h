@@ -40,10 +40,14 @@
 #define SYS_getmainvars 2011
 #define SYS_rt_sigaction 134
 #define SYS_writev 66
+#define SYS_readv 65 //MWG
+#define SYS_preadv 69 //MWG
+#define SYS_pwritev 70 //MWG
 #define SYS_gettimeofday 169
 #define SYS_times 153
 #define SYS_fcntl 25
 #define SYS_ftruncate 46
+#define SYS_fsync 82 //MWG
 #define SYS_getdents 61
 #define SYS_dup 23
 #define SYS_readlinkat 78
@@ -54,6 +58,7 @@
 #define SYS_getrusage 165
 #define SYS_clock_gettime 113
 #define SYS_register_user_memory_due_trap_handler 447 //MWG hack
+#define SYS_checkpoint 448 //MWG
 
 #define OLD_SYSCALL_THRESHOLD 1024
 #define SYS_open 1024
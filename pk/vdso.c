@@ -0,0 +1,51 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+// A vDSO for reading the clock without a trap: a read-only time page with
+// the timebase, followed by a code page (vdso.S) that computes the time from
+// it in user mode. Both are mapped right below the user stack for every run
+// of the program. There is no ELF image, so rather than AT_SYSINFO_EHDR,
+// which libcs would try to parse, the time page's address is passed in
+// AT_PK_VDSO; a libc that knows about it calls the entry points listed there.
+
+#include "pk.h"
+#include "vm.h"
+#include "vdso.h"
+
+//MWG: Returns the address of the time page, or 0 if there is none.
+#ifdef __riscv64
+extern char vdso_text_start, vdso_text_end, __vdso_clock_gettime, __vdso_gettimeofday;
+
+uintptr_t vdso_map()
+{
+  if (!current.elf64) // the code page is RV64
+    return 0;
+
+  uintptr_t data = current.stack_bottom - 2*RISCV_PGSIZE;
+  uintptr_t text = data + RISCV_PGSIZE;
+  size_t text_size = &vdso_text_end - &vdso_text_start;
+  kassert(text_size <= RISCV_PGSIZE);
+
+  vdso_data_t d = {
+    .magic = VDSO_MAGIC,
+    .freq = clock_freq(),
+    .use_cycle = !timebase_freq,
+    .clock_gettime = text + (&__vdso_clock_gettime - &vdso_text_start),
+    .gettimeofday = text + (&__vdso_gettimeofday - &vdso_text_start),
+  };
+
+  if (vm_map_user_copy(data, &d, sizeof(d), PROT_READ) != 0
+      || vm_map_user_copy(text, &vdso_text_start, text_size, PROT_READ|PROT_EXEC) != 0)
+    return 0;
+  return data;
+}
+#else
+uintptr_t vdso_map()
+{
+  return 0; // the code page is RV64
+}
+#endif
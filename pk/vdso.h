@@ -0,0 +1,32 @@
+// See LICENSE for license details.
+
+/*
+ * Author: Mark Gottscho
+ * Email: mgottscho@ucla.edu
+ */
+
+#ifndef _PK_VDSO_H
+#define _PK_VDSO_H
+
+// Layout of the time page pk maps below the user stack; its address is
+// passed in the AT_PK_VDSO auxv entry. The code page follows it, and holds
+// the entry points whose addresses are given here.
+#define VDSO_MAGIC 0x6f7364766b70 // "pkvdso"
+#define VDSO_FREQ 8               // ticks per second
+#define VDSO_USE_CYCLE 16         // count cycles instead of reading time
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+typedef struct {
+  uint64_t magic;
+  uint64_t freq;
+  uint64_t use_cycle;
+  uint64_t clock_gettime; // int (clockid_t, struct timespec*)
+  uint64_t gettimeofday;  // int (struct timeval*, void*)
+} vdso_data_t;
+
+uintptr_t vdso_map();
+#endif
+
+#endif
@@ -18,6 +18,21 @@ typedef struct {
 spinlock_t vm_lock = SPINLOCK_INIT;
 static vmr_t* vmrs;
 
+// Sorted, non-overlapping list of the mapped user ranges, so that address
+// validity can be checked without walking the page table.  Readers don't
+// take vm_lock (they may run in the DUE path); they retry if ranges_seq
+// changed underneath them.
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+} range_t;
+
+#define MAX_RANGES (RISCV_PGSIZE / sizeof(range_t))
+static range_t* ranges;
+static size_t nranges;
+static int ranges_overflow;
+static volatile unsigned ranges_seq;
+
 pte_t* root_page_table;
 static uintptr_t first_free_page;
 static size_t next_free_page;
@@ -31,6 +46,21 @@ static uintptr_t __page_alloc()
   return addr;
 }
 
+// Allocates npage contiguous, zeroed pages from the page pool for pk's own
+// use.  Returns 0 if the pool is exhausted.
+uintptr_t kernel_page_alloc(size_t npage)
+{
+  uintptr_t addr = 0;
+  spinlock_lock(&vm_lock);
+    if (npage && next_free_page + npage <= free_pages) {
+      addr = __page_alloc();
+      for (size_t i = 1; i < npage; i++)
+        __page_alloc();
+    }
+  spinlock_unlock(&vm_lock);
+  return addr;
+}
+
 static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
                           size_t offset, unsigned refcnt, int prot)
 {
@@ -66,6 +96,101 @@ static void __vmr_decref(vmr_t* v, unsigned dec)
   }
 }
 
+static void __range_insert_at(size_t i, uintptr_t start, uintptr_t end)
+{
+  if (nranges == MAX_RANGES) {
+    ranges_overflow = 1;
+    return;
+  }
+  memmove(&ranges[i+1], &ranges[i], (nranges - i) * sizeof(range_t));
+  ranges[i].start = start;
+  ranges[i].end = end;
+  nranges++;
+}
+
+static void __range_delete_at(size_t i)
+{
+  memmove(&ranges[i], &ranges[i+1], (nranges - i - 1) * sizeof(range_t));
+  nranges--;
+}
+
+static void __ranges_update(uintptr_t start, uintptr_t end, int mapped)
+{
+  if (!ranges)
+    ranges = (range_t*)__page_alloc();
+
+  ranges_seq++;
+  mb();
+
+  size_t i = 0;
+  while (i < nranges && ranges[i].end <= start)
+    i++;
+
+  // carve [start, end) out of the existing ranges
+  while (i < nranges && ranges[i].start < end) {
+    range_t r = ranges[i];
+    if (r.start < start && r.end > end) {
+      ranges[i].end = start;
+      __range_insert_at(++i, end, r.end);
+      break;
+    } else if (r.start < start) {
+      ranges[i++].end = start;
+    } else if (r.end > end) {
+      ranges[i].start = end;
+      break;
+    } else {
+      __range_delete_at(i);
+    }
+  }
+
+  if (mapped) {
+    i = 0;
+    while (i < nranges && ranges[i].start < start)
+      i++;
+    if (i > 0 && ranges[i-1].end == start) {
+      ranges[i-1].end = end;
+      if (i < nranges && ranges[i].start == end) {
+        ranges[i-1].end = ranges[i].end;
+        __range_delete_at(i);
+      }
+    } else if (i < nranges && ranges[i].start == end) {
+      ranges[i].start = start;
+    } else {
+      __range_insert_at(i, start, end);
+    }
+  }
+
+  mb();
+  ranges_seq++;
+}
+
+// Returns nonzero if vaddr lies in a mapped user range.  O(log n).
+int vaddr_is_mapped(uintptr_t vaddr)
+{
+  unsigned seq;
+  int res;
+
+  do {
+    seq = ranges_seq;
+    mb();
+    if (!ranges || ranges_overflow)
+      return 1;
+
+    size_t lo = 0, hi = nranges;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (ranges[mid].end <= vaddr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    res = lo < nranges && ranges[lo].start <= vaddr;
+    mb();
+  } while ((seq & 1) || seq != ranges_seq);
+
+  return res;
+}
+
 static size_t pte_ppn(pte_t pte)
 {
   return pte >> PTE_PPN_SHIFT;
@@ -190,6 +315,41 @@ int __valid_user_range(uintptr_t vaddr, size_t len)
   return vaddr >= current.first_free_paddr && vaddr + len <= current.mmap_max;
 }
 
+size_t fault_around_pages = 1; //MWG: -f
+
+// A not-yet-populated user page that belongs to v
+static int __fault_around_ok(uintptr_t vaddr, vmr_t* v)
+{
+  pte_t* pte = __walk(vaddr);
+  return pte && *pte && !(*pte & PTE_V) && (vmr_t*)*pte == v;
+}
+
+// Populates [lo, hi), all of whose pages must be unpopulated pages of v.
+// User memory is identity-mapped, so file-backed pages are read with a
+// single pread, however many there are.
+static void __populate_run(vmr_t* v, uintptr_t lo, uintptr_t hi)
+{
+  for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+    *__walk(a) = pte_create(a >> RISCV_PGSHIFT, PROT_READ|PROT_WRITE, 0);
+  flush_tlb();
+  if (v->file)
+  {
+    size_t flen = MIN(hi - lo, v->length - (lo - v->addr));
+    ssize_t ret = file_pread(v->file, (void*)lo, flen, lo - v->addr + v->offset);
+    kassert(ret > 0);
+    if (ret < hi - lo)
+      memset((void*)lo + ret, 0, hi - lo - ret);
+  }
+  else
+    memset((void*)lo, 0, hi - lo);
+  __vmr_decref(v, (hi - lo) / RISCV_PGSIZE);
+  for (uintptr_t a = lo; a < hi; a += RISCV_PGSIZE)
+    *__walk(a) = pte_create(a >> RISCV_PGSHIFT, v->prot, 1);
+}
+
+//MWG: Besides the faulting page, populates the other pages of the same VMR
+//that are still unpopulated, in the aligned block of fault_around_pages pages
+//around it (-f<N>), so that the TLB is flushed once for all of them.
 static int __handle_page_fault(uintptr_t vaddr, int prot)
 {
   uintptr_t vpn = vaddr >> RISCV_PGSHIFT;
@@ -201,23 +361,17 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
     return -1;
   else if (!(*pte & PTE_V))
   {
-    uintptr_t ppn = vpn;
-
     vmr_t* v = (vmr_t*)*pte;
-    *pte = pte_create(ppn, PROT_READ|PROT_WRITE, 0);
-    flush_tlb();
-    if (v->file)
-    {
-      size_t flen = MIN(RISCV_PGSIZE, v->length - (vaddr - v->addr));
-      ssize_t ret = file_pread(v->file, (void*)vaddr, flen, vaddr - v->addr + v->offset);
-      kassert(ret > 0);
-      if (ret < RISCV_PGSIZE)
-        memset((void*)vaddr + ret, 0, RISCV_PGSIZE - ret);
-    }
-    else
-      memset((void*)vaddr, 0, RISCV_PGSIZE);
-    __vmr_decref(v, 1);
-    *pte = pte_create(ppn, v->prot, 1);
+
+    uintptr_t block = fault_around_pages * RISCV_PGSIZE;
+    uintptr_t block_lo = MAX(v->addr, vaddr - vaddr % block);
+    uintptr_t block_hi = MIN(ROUNDUP(v->addr + v->length, RISCV_PGSIZE), block_lo + block);
+    uintptr_t lo = vaddr, hi = vaddr + RISCV_PGSIZE;
+    while (lo > block_lo && __fault_around_ok(lo - RISCV_PGSIZE, v))
+      lo -= RISCV_PGSIZE;
+    while (hi < block_hi && __fault_around_ok(hi, v))
+      hi += RISCV_PGSIZE;
+    __populate_run(v, lo, hi);
   }
 
   pte_t perms = pte_create(0, prot, 1);
@@ -238,6 +392,11 @@ int handle_page_fault(uintptr_t vaddr, int prot)
 
 static void __do_munmap(uintptr_t addr, size_t len)
 {
+  len = ROUNDUP(len, RISCV_PGSIZE); // the whole last page goes, as below
+  invalidate_due_decisions(addr, len);
+  sw_due_forget(addr, len); //MWG
+  __ranges_update(addr, addr + len, 0);
+
   for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk(a);
@@ -267,6 +426,8 @@ uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t*
   if (!v)
     return (uintptr_t)-1;
 
+  invalidate_due_decisions(addr, length);
+
   for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
   {
     pte_t* pte = __walk_create(a);
@@ -278,9 +439,13 @@ uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t*
     *pte = (pte_t)v;
   }
 
-  if (!have_vm || (flags & MAP_POPULATE))
+  __ranges_update(addr, addr + npage * RISCV_PGSIZE, 1);
+
+  if (!have_vm || (flags & MAP_POPULATE)) {
+    __populate_run(v, addr, addr + npage * RISCV_PGSIZE); //MWG: all at once
     for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
       kassert(__handle_page_fault(a, prot) == 0);
+  }
 
   return addr;
 }
@@ -401,16 +566,282 @@ void __map_kernel_range(uintptr_t vaddr, uintptr_t paddr, size_t len, int prot)
   }
 }
 
+// Returns the first page in [vaddr, end) that is resident and user-readable,
+// or 0 if there is none.
+uintptr_t next_resident_page(uintptr_t vaddr, uintptr_t end)
+{
+  uintptr_t res = 0;
+  spinlock_lock(&vm_lock);
+    for (uintptr_t a = ROUNDDOWN(vaddr, RISCV_PGSIZE); a < end; )
+    {
+      pte_t* pte = __walk(a);
+      if (pte == 0) {
+        a = ROUNDDOWN(a, SUPERPAGE_SIZE) + SUPERPAGE_SIZE;
+        continue;
+      }
+      if ((*pte & PTE_V) && PTE_UR(*pte)) {
+        res = a;
+        break;
+      }
+      a += RISCV_PGSIZE;
+    }
+  spinlock_unlock(&vm_lock);
+  return res;
+}
+
+// Takes user access away from the resident page holding vaddr, leaving it
+// accessible to the supervisor. Returns the old PTE, or 0 if the page isn't
+// a resident user page.
+pte_t revoke_user_page(uintptr_t vaddr)
+{
+  pte_t res = 0;
+  spinlock_lock(&vm_lock);
+    pte_t* pte = __walk(vaddr);
+    if (pte && (*pte & PTE_V) && PTE_UR(*pte)) {
+      res = *pte;
+      *pte = pte_create(pte_ppn(res), PROT_READ|PROT_WRITE|PROT_EXEC, 0);
+      flush_tlb();
+    }
+  spinlock_unlock(&vm_lock);
+  return res;
+}
+
+// Undoes revoke_user_page(), unless the mapping has changed since.
+void restore_user_page(uintptr_t vaddr, pte_t old)
+{
+  spinlock_lock(&vm_lock);
+    pte_t* pte = __walk(vaddr);
+    if (pte && *pte == pte_create(pte_ppn(old), PROT_READ|PROT_WRITE|PROT_EXEC, 0)) {
+      *pte = old;
+      flush_tlb();
+    }
+  spinlock_unlock(&vm_lock);
+}
+
+// A run of user pages with the same protection, as saved in a checkpoint.
+// Resident runs are followed by their contents; the list ends with npage = 0.
+typedef struct {
+  uint64_t addr;
+  uint64_t npage;
+  int64_t prot;
+  uint64_t resident;
+} vm_run_t;
+
+static int pte_prot(pte_t pte)
+{
+  return (PTE_UR(pte) ? PROT_READ : 0) | (PTE_UW(pte) ? PROT_WRITE : 0) | (PTE_UX(pte) ? PROT_EXEC : 0);
+}
+
+static int page_is_zero(uintptr_t addr)
+{
+  for (long* p = (long*)addr; p < (long*)(addr + RISCV_PGSIZE); p++)
+    if (*p)
+      return 0;
+  return 1;
+}
+
+static int __vm_checkpoint_run(file_t* f, off_t* off, vm_run_t* run)
+{
+  size_t len = run->npage * RISCV_PGSIZE;
+  if (file_pwrite(f, run, sizeof(*run), *off) != sizeof(*run))
+    return -1;
+  *off += sizeof(*run);
+  if (run->resident) {
+    if (file_pwrite(f, (void*)(uintptr_t)run->addr, len, *off) != (ssize_t)len)
+      return -1;
+    *off += len;
+  }
+  return 0;
+}
+
+// Writes the user address space to f, starting at off.  File-backed pages
+// that haven't been touched yet are read in first, so the checkpoint doesn't
+// depend on the program's files.  Untouched anonymous pages and resident
+// pages that are all zeros are saved as bare mappings.
+int vm_checkpoint(file_t* f, off_t off)
+{
+  vm_run_t run = {0, 0, 0, 0};
+  int ret = 0;
+
+  spinlock_lock(&vm_lock);
+    for (uintptr_t a = current.first_user_vaddr, next; ret == 0; a = next)
+    {
+      int mapped = 0, resident = 0, prot = 0;
+      next = a + RISCV_PGSIZE;
+
+      if (a < current.mmap_max)
+      {
+        pte_t* pte = __walk(a);
+        if (pte == 0)
+          next = ROUNDDOWN(a, SUPERPAGE_SIZE) + SUPERPAGE_SIZE;
+        else if (*pte)
+        {
+          if (!(*pte & PTE_V) && ((vmr_t*)*pte)->file)
+            __handle_page_fault(a, PROT_NONE);
+          mapped = 1;
+          if (*pte & PTE_V) {
+            resident = !page_is_zero(a);
+            prot = pte_prot(*pte);
+          } else {
+            prot = ((vmr_t*)*pte)->prot;
+          }
+        }
+      }
+
+      if (run.npage && (!mapped || resident != run.resident || prot != run.prot
+                        || a != run.addr + run.npage * RISCV_PGSIZE)) {
+        ret = __vm_checkpoint_run(f, &off, &run);
+        run.npage = 0;
+      }
+
+      if (a >= current.mmap_max)
+        break;
+
+      if (mapped) {
+        if (run.npage == 0) {
+          run.addr = a;
+          run.prot = prot;
+          run.resident = resident;
+        }
+        run.npage++;
+      }
+    }
+  spinlock_unlock(&vm_lock);
+
+  if (ret == 0 && file_pwrite(f, &run, sizeof(run), off) != sizeof(run))
+    ret = -1;
+  return ret;
+}
+
+// Recreates the user address space saved by vm_checkpoint().
+int vm_restore(file_t* f, off_t off)
+{
+  vm_run_t run;
+  int ret = 0;
+
+  spinlock_lock(&vm_lock);
+    while (1)
+    {
+      if (file_pread(f, &run, sizeof(run), off) != sizeof(run)) {
+        ret = -1;
+        break;
+      }
+      off += sizeof(run);
+      if (run.npage == 0)
+        break;
+
+      size_t len = run.npage * RISCV_PGSIZE;
+      if (!run.resident) {
+        if (__do_mmap(run.addr, len, run.prot, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0) != run.addr) {
+          ret = -1;
+          break;
+        }
+        continue;
+      }
+
+      // populate writable, fill in, then apply the saved protection
+      if (__do_mmap(run.addr, len, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, 0, 0) != run.addr
+          || file_pread(f, (void*)(uintptr_t)run.addr, len, off) != (ssize_t)len) {
+        ret = -1;
+        break;
+      }
+      off += len;
+      for (uintptr_t a = run.addr; a < run.addr + len; a += RISCV_PGSIZE) {
+        pte_t* pte = __walk(a);
+        *pte = pte_create(pte_ppn(*pte), run.prot, 1);
+      }
+      flush_tlb();
+    }
+  spinlock_unlock(&vm_lock);
+
+  return ret;
+}
+
+// Hashes the address and contents of every resident user page that has been
+// written to (PTE_D), in address order.  Untouched pages are the same in
+// every run of the program, so only dirty pages can tell two runs apart.
+uint64_t vm_dirty_digest(size_t* npages)
+{
+  uint64_t h = FNV_OFFSET_BASIS;
+  *npages = 0;
+
+  spinlock_lock(&vm_lock);
+    for (uintptr_t a = current.first_user_vaddr; a < current.mmap_max; )
+    {
+      pte_t* pte = __walk(a);
+      if (pte == 0) {
+        a = ROUNDDOWN(a, SUPERPAGE_SIZE) + SUPERPAGE_SIZE;
+        continue;
+      }
+      if ((*pte & PTE_V) && (*pte & PTE_D)) {
+        h = fnv1a(h, &a, sizeof(a));
+        h = fnv1a(h, (void*)a, RISCV_PGSIZE);
+        (*npages)++;
+      }
+      a += RISCV_PGSIZE;
+    }
+  spinlock_unlock(&vm_lock);
+
+  return h;
+}
+
+//MWG: Makes a buffer resident before pk or the host accesses it. A user
+//buffer is handled in one pass over its PTEs under vm_lock: unpopulated
+//pages are populated in runs, as MAP_POPULATE does, and pages about to be
+//written are marked dirty, since the host's writes don't go through the MMU.
+//Anything that pass can't deal with (an unmapped page, missing permissions,
+//a kernel buffer, or vm_lock being held already) falls back to touching each
+//page, which takes the regular page fault.
 void populate_mapping(const void* start, size_t size, int prot)
 {
   uintptr_t a0 = ROUNDDOWN((uintptr_t)start, RISCV_PGSIZE);
-  for (uintptr_t a = a0; a < (uintptr_t)start+size; a += RISCV_PGSIZE)
+  uintptr_t a1 = (uintptr_t)start + size;
+  int slow = 1;
+
+  if (size && __valid_user_range(a0, a1 - a0) && spinlock_trylock(&vm_lock) == 0)
   {
-    if (prot & PROT_WRITE)
-      atomic_add((int*)a, 0);
-    else
-      atomic_read((int*)a);
+    pte_t perms = pte_create(0, prot, 1);
+    pte_t* pte = 0;
+    int changed = 0;
+    slow = 0;
+    for (uintptr_t a = a0; a < a1; a += RISCV_PGSIZE, pte++)
+    {
+      // PTEs are contiguous within a leaf table
+      if (!pte || (a >> RISCV_PGSHIFT) % (1 << RISCV_PGLEVEL_BITS) == 0)
+        pte = __walk(a);
+      if (pte && *pte && !(*pte & PTE_V))
+      {
+        vmr_t* v = (vmr_t*)*pte;
+        uintptr_t hi = a + RISCV_PGSIZE;
+        while (hi < ROUNDUP(a1, RISCV_PGSIZE) && __fault_around_ok(hi, v))
+          hi += RISCV_PGSIZE;
+        __populate_run(v, a, hi);
+        changed = 1;
+      }
+      if (!pte || (*pte & perms) != perms)
+      {
+        slow = 1;
+        break;
+      }
+      if ((prot & PROT_WRITE) && (*pte & (PTE_R | PTE_D)) != (PTE_R | PTE_D))
+      {
+        *pte |= PTE_R | PTE_D;
+        changed = 1;
+      }
+    }
+    if (changed)
+      flush_tlb();
+    spinlock_unlock(&vm_lock);
   }
+
+  if (slow)
+    for (uintptr_t a = a0; a < a1; a += RISCV_PGSIZE)
+    {
+      if (prot & PROT_WRITE)
+        atomic_add((int*)a, 0);
+      else
+        atomic_read((int*)a);
+    }
 }
 
 static uintptr_t sbi_top_paddr()
@@ -480,6 +911,50 @@ void supervisor_vm_init()
   write_csr(sptbr, root_pt);
 }
 
+static void __map_user_stack()
+{
+  size_t stack_size = RISCV_PGSIZE * CLAMP(mem_size/(RISCV_PGSIZE*32), 1, 256);
+  current.stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
+  current.stack_top = current.stack_bottom + stack_size;
+  kassert(current.stack_bottom != (uintptr_t)-1);
+}
+
+//MWG: Maps a copy of len bytes at src into user memory at page-aligned addr,
+//with permissions prot, and keeps the heap from growing into it. Returns 0,
+//or -1 if addr can't be mapped.
+int vm_map_user_copy(uintptr_t addr, const void* src, size_t len, int prot)
+{
+  int ret = -1;
+  spinlock_lock(&vm_lock);
+    if (__do_mmap(addr, len, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, 0, 0) == addr)
+    {
+      memcpy((void*)addr, src, len);
+      for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
+      {
+        pte_t* pte = __walk(a);
+        *pte = pte_create(pte_ppn(*pte), prot, 1);
+      }
+      flush_tlb();
+      if (addr < current.brk_max)
+        current.brk_max = addr;
+      ret = 0;
+    }
+  spinlock_unlock(&vm_lock);
+  return ret;
+}
+
+// Unmaps all of user memory and maps a fresh stack, leaving things as
+// pk_vm_init() did, so that the program can be loaded again.
+void vm_reset_user()
+{
+  spinlock_lock(&vm_lock);
+    __do_munmap(current.first_user_vaddr, current.mmap_max - current.first_user_vaddr);
+    current.brk = 0;
+    current.brk_max = current.mmap_max;
+    __map_user_stack();
+  spinlock_unlock(&vm_lock);
+}
+
 uintptr_t pk_vm_init()
 {
   // keep RV32 addresses positive
@@ -489,10 +964,7 @@ uintptr_t pk_vm_init()
   __map_kernel_range(0, 0, current.first_free_paddr, PROT_READ|PROT_WRITE|PROT_EXEC);
   __map_kernel_range(first_free_page, first_free_page, free_pages * RISCV_PGSIZE, PROT_READ|PROT_WRITE);
 
-  size_t stack_size = RISCV_PGSIZE * CLAMP(mem_size/(RISCV_PGSIZE*32), 1, 256);
-  current.stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
-  current.stack_top = current.stack_bottom + stack_size;
-  kassert(current.stack_bottom != (uintptr_t)-1);
+  __map_user_stack();
 
   uintptr_t kernel_stack_top = __page_alloc() + RISCV_PGSIZE;
   return kernel_stack_top;
@@ -36,8 +36,15 @@
 void vm_init();
 void supervisor_vm_init();
 uintptr_t pk_vm_init();
+void vm_reset_user();
 int handle_page_fault(uintptr_t vaddr, int prot);
 void populate_mapping(const void* start, size_t size, int prot);
+uintptr_t next_resident_page(uintptr_t vaddr, uintptr_t end);
+uintptr_t kernel_page_alloc(size_t npage);
+int vaddr_is_mapped(uintptr_t vaddr);
+int vm_checkpoint(file_t* f, off_t off);
+int vm_restore(file_t* f, off_t off);
+uint64_t vm_dirty_digest(size_t* npages);
 void __map_kernel_range(uintptr_t va, uintptr_t pa, size_t len, int prot);
 int __valid_user_range(uintptr_t vaddr, size_t len);
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* file, off_t offset);
@@ -49,6 +56,11 @@ uintptr_t do_brk(uintptr_t addr);
 
 typedef uintptr_t pte_t;
 extern pte_t* root_page_table;
+extern size_t fault_around_pages; //MWG: -f
+
+int vm_map_user_copy(uintptr_t addr, const void* src, size_t len, int prot);
+pte_t revoke_user_page(uintptr_t vaddr);
+void restore_user_page(uintptr_t vaddr, pte_t old);
 
 static inline void flush_tlb()
 {
@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+#=========================================================================
+# gen-insn-table.py [encoding.h] > insn_table.h
+#=========================================================================
+#
+# Generates pk/insn_table.h, the instruction-legality tables that
+# pk/due_filter.c uses to drop illegal candidates for instruction-memory
+# DUEs. An instruction is legal if it matches one of the DECLARE_INSN
+# patterns in encoding.h. Rerun this whenever encoding.h changes.
+#
+# 32-bit instructions are looked up by opcode and funct3, then by funct7,
+# which gives a bitmap of the legal rs2 fields. The few patterns that also
+# fix rd, rs1 or the rest of the immediate (the privileged SYSTEM
+# instructions) are listed separately, and are only checked when the
+# opcode and funct3 say one of them could match. Compressed instructions
+# are few enough bits to look up directly.
+
+import re
+import sys
+
+path = sys.argv[1] if len(sys.argv) > 1 else 'encoding.h'
+src = open(path).read()
+match = dict((k, int(v, 16)) for k, v in re.findall(r'#define MATCH_(\w+)\s+(0x[0-9a-fA-F]+)', src))
+mask = dict((k, int(v, 16)) for k, v in re.findall(r'#define MASK_(\w+)\s+(0x[0-9a-fA-F]+)', src))
+insns = [(match[m], mask[k]) for _, m, k in re.findall(r'DECLARE_INSN\((\w+),\s*MATCH_(\w+),\s*MASK_(\w+)\)', src)]
+
+KEY = 0xfff0707f  # funct7, rs2, funct3, opcode
+
+def major(insn):
+    return ((insn >> 2) & 0x1f) << 3 | ((insn >> 12) & 7)
+
+def free_values(m, bits):
+    # every value of the bits in `bits` that `m` leaves free
+    free = [b for b in bits if not (m >> b) & 1]
+    for i in range(1 << len(free)):
+        yield sum(((i >> j) & 1) << b for j, b in enumerate(free))
+
+rs2 = {}    # (major, funct7) -> bitmap of legal rs2 fields
+wide = []   # patterns that look further than KEY
+wide_majors = set()
+compressed = [0] * (1 << 16)
+
+for mt, mk in insns:
+    if mt & 3 != 3:
+        for v in free_values(mk, range(16)):
+            compressed[(mt & 0xffff) | v] = 1
+        continue
+    if mk & ~KEY:
+        wide.append((mt, mk))
+        for v in free_values(mk, [2, 3, 4, 5, 6, 12, 13, 14]):
+            wide_majors.add(major(mt | v))
+        continue
+    for v in free_values(mk, [2, 3, 4, 5, 6, 12, 13, 14] + list(range(20, 32))):
+        insn = mt | v
+        k = (major(insn), insn >> 25)
+        rs2[k] = rs2.get(k, 0) | 1 << ((insn >> 20) & 0x1f)
+
+masks = [0]
+rows = [tuple([0] * 128)]
+major_row = []
+for m in range(256):
+    row = []
+    for f7 in range(128):
+        b = rs2.get((m, f7), 0)
+        if b not in masks:
+            masks.append(b)
+        row.append(masks.index(b))
+    row = tuple(row)
+    if row not in rows:
+        rows.append(row)
+    major_row.append(rows.index(row) | (0x80 if m in wide_majors else 0))
+
+assert len(rows) < 0x80 and len(masks) <= 0x100
+
+out = sys.stdout
+out.write('// See LICENSE for license details.\n')
+out.write('// Generated from encoding.h by scripts/gen-insn-table.py. Do not edit.\n\n')
+out.write('#ifndef _PK_INSN_TABLE_H\n#define _PK_INSN_TABLE_H\n\n')
+out.write('#define INSN_TABLE_WIDE 0x80\n\n')
+
+out.write('// indexed by opcode[6:2] and funct3: a row of insn_funct7[], plus\n')
+out.write('// INSN_TABLE_WIDE if a pattern in insn_wide[] may match\n')
+out.write('static const uint8_t insn_major[256] = {\n')
+for i in range(0, 256, 16):
+    out.write('  ' + ' '.join('0x%02x,' % v for v in major_row[i:i+16]) + '\n')
+out.write('};\n\n')
+
+out.write('// indexed by funct7: an entry of insn_rs2[]\n')
+out.write('static const uint8_t insn_funct7[%d][128] = {\n' % len(rows))
+for r in rows:
+    out.write('  {\n')
+    for i in range(0, 128, 32):
+        out.write('    ' + ','.join('%d' % v for v in r[i:i+32]) + ',\n')
+    out.write('  },\n')
+out.write('};\n\n')
+
+out.write('// bit i set if rs2 == i is legal\n')
+out.write('static const uint32_t insn_rs2[%d] = {\n' % len(masks))
+for i in range(0, len(masks), 4):
+    out.write('  ' + ' '.join('0x%08x,' % v for v in masks[i:i+4]) + '\n')
+out.write('};\n\n')
+
+out.write('// patterns that also fix bits outside funct7, rs2, funct3 and opcode\n')
+out.write('static const struct { uint32_t match, mask; } insn_wide[%d] = {\n' % len(wide))
+for mt, mk in wide:
+    out.write('  {0x%08x, 0x%08x},\n' % (mt, mk))
+out.write('};\n\n')
+
+out.write('// bit i set if the 16-bit instruction i is legal\n')
+out.write('static const uint32_t insn_compressed[%d] = {\n' % (len(compressed) // 32))
+words = [sum(compressed[i + j] << j for j in range(32)) for i in range(0, len(compressed), 32)]
+for i in range(0, len(words), 8):
+    out.write('  ' + ' '.join('0x%08x,' % v for v in words[i:i+8]) + '\n')
+out.write('};\n\n')
+
+out.write('#endif\n')